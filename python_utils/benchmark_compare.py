@@ -0,0 +1,42 @@
+"""Compares two results of TLR_BENCH --json, e.g. from two commits.
+
+Usage: python benchmark_compare.py old.json new.json [threshold]
+
+Prints the ratio of the median times of every benchmark present in both
+files and flags the ones slower by more than threshold (default 0.10, 10%).
+Exits with 1 if any benchmark regressed, so it can be used in a script.
+"""
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        results = json.load(f)["benchmarks"]
+    return {(r["name"], r["stems"], r["threads"]): r for r in results}
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 3:
+        print(__doc__)
+        sys.exit(2)
+    old = load(sys.argv[1])
+    new = load(sys.argv[2])
+    threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 0.10
+
+    regressed = False
+    print("%-18s %7s %7s %12s %12s %8s" % ("benchmark", "stems", "threads",
+                                          "old (ms)", "new (ms)", "ratio"))
+    for key in sorted(set(old) & set(new)):
+        old_time = old[key]["median_s"]
+        new_time = new[key]["median_s"]
+        ratio = new_time / old_time if old_time > 0 else float("inf")
+        flag = ""
+        if ratio > 1 + threshold:
+            flag = " SLOWER"
+            regressed = True
+        elif ratio < 1 - threshold:
+            flag = " faster"
+        print("%-18s %7d %7d %12.3f %12.3f %8.2f%s" % (key[0], key[1], key[2],
+              old_time*1e3, new_time*1e3, ratio, flag))
+    sys.exit(1 if regressed else 0)
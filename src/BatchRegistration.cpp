@@ -0,0 +1,354 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "BatchRegistration.h"
+#include "HierarchicalRegistration.h"
+#include "StemMapCache.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <time.h>
+#include <omp.h>
+
+namespace tlr
+{
+
+bool
+ParseOption(const std::vector<std::string>& args, size_t& i,
+            RegistrationOptions& options)
+{
+  const std::string& arg = args[i];
+  bool hasValue = i + 1 < args.size();
+  if (arg == "--streaming")
+    options.streaming = true;
+  else if (arg == "--kelbe")
+    options.kelbeRegistration = true;
+  else if (arg == "--batch-size" && hasValue)
+    options.streamBatchSize = std::stoul(args[++i]);
+  else if (arg == "--confidence" && hasValue)
+    options.confidence = std::stod(args[++i]);
+  else if (arg == "--top-k" && hasValue)
+    options.topK = std::stoul(args[++i]);
+  else if (arg == "--4dof")
+    options.fourDof = true;
+  else if (arg == "--hierarchical" && hasValue)
+    options.coarseStems = std::stoul(args[++i]);
+  else if (arg == "--irls" && hasValue)
+    options.refineIterations = std::stoul(args[++i]);
+  else if (arg == "--cluster")
+    options.clusterHypotheses = true;
+  else if (arg == "--time-limit" && hasValue)
+    options.timeLimit = std::stod(args[++i]);
+  else if (arg == "--engine" && hasValue)
+  {
+    const std::string& engine = args[++i];
+    if (engine != "new" && engine != "kelbe" && engine != "hough")
+      throw std::invalid_argument("Unknown engine " + engine);
+    options.kelbeRegistration = engine == "kelbe";
+    options.houghVoting = engine == "hough";
+  }
+  else
+    return false;
+  return true;
+}
+
+std::vector<BatchJob>
+LoadBatchManifest(const std::string& path)
+{
+  std::ifstream file(path);
+  if (!file) throw std::runtime_error("Cannot open " + path);
+
+  std::vector<BatchJob> jobs;
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline(file, line))
+  {
+    ++lineNumber;
+    std::istringstream stream(line);
+    std::vector<std::string> args;
+    std::string arg;
+    while (stream >> arg) args.push_back(arg);
+    if (args.empty() || args[0][0] == '#') continue;
+
+    std::string where = path + ":" + std::to_string(lineNumber) + ": ";
+    if (args.size() < 5)
+      throw std::runtime_error(where + "expected path_source path_target "
+                               "minimum_radius radius_error_tol RANSAC_error_tol");
+    BatchJob job;
+    try
+    {
+      job.pathSource = args[0];
+      job.pathTarget = args[1];
+      job.minDiam = std::stod(args[2]);
+      job.options.diamErrorTol = std::stod(args[3]);
+      job.options.RANSACtol = std::stod(args[4]);
+      for (size_t i = 5; i < args.size(); ++i)
+      {
+        if (args[i] == "--output" && i + 1 < args.size())
+          job.outputPath = args[++i];
+        else if (args[i] == "--stats" && i + 1 < args.size())
+          job.statsPath = args[++i];
+        else if (!ParseOption(args, i, job.options))
+          throw std::runtime_error("unknown argument " + args[i]);
+      }
+    }
+    catch (const std::exception& e)
+    {
+      throw std::runtime_error(where + e.what());
+    }
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+BatchRegistration::BatchRegistration(const std::vector<BatchJob>& jobs,
+                                     const std::string& cacheDir) :
+  jobs(jobs),
+  cacheDir(cacheDir),
+  reports(jobs.size()),
+  failed(jobs.size(), false)
+{
+}
+
+BatchRegistration::~BatchRegistration()
+{
+}
+
+void
+BatchRegistration::run()
+{
+  if (this->cacheDir.empty()) this->loadStemMaps();
+  this->prepareStemMaps();
+  this->stemMaps.clear(); // The prepared maps have their own copy
+  if (this->jobs.empty()) return;
+
+  /* As many jobs at once as there are threads, the threads left over going
+     to the parallel loops of each job. A single job keeps all the threads. */
+  int nThreads = omp_get_max_threads();
+  int nConcurrent = std::min((int)this->jobs.size(), nThreads);
+  int nThreadsPerJob = std::max(1, nThreads / nConcurrent);
+  omp_set_max_active_levels(2);
+
+  #pragma omp parallel for schedule(dynamic) num_threads(nConcurrent)
+  for (size_t i = 0; i < this->jobs.size(); ++i)
+    this->runJob(i, nThreadsPerJob);
+}
+
+/* Loads, in parallel, every stem map file used by the jobs once. A file
+   which can't be loaded only fails the jobs using it. */
+void
+BatchRegistration::loadStemMaps()
+{
+  std::vector<LoadKey> keys;
+  for (const auto& job : this->jobs)
+  {
+    for (const std::string& path : {job.pathSource, job.pathTarget})
+    {
+      LoadKey key(path, job.minDiam);
+      if (this->stemMaps.count(key) != 0) continue;
+      this->stemMaps[key] = StemMap();
+      keys.push_back(key);
+    }
+  }
+
+  std::vector<StemMap> loaded(keys.size());
+  std::vector<std::string> errors(keys.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    try
+    {
+      loaded[i].loadStemMapFile(keys[i].first, keys[i].second);
+    }
+    catch (const std::exception& e)
+    {
+      errors[i] = e.what();
+    }
+  }
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    if (errors[i].empty())
+      this->stemMaps[keys[i]] = loaded[i];
+    else
+    {
+      this->stemMaps.erase(keys[i]);
+      this->loadErrors[keys[i]] = errors[i];
+    }
+  }
+}
+
+/* Whether the maps of a job are prepared with their triplets. A hierarchical
+   registration makes its own from the largest stems only. */
+static bool
+PreparesTriplets(const RegistrationOptions& options)
+{
+  return NeedsTriplets(options) && options.coarseStems == 0;
+}
+
+// Registers a job and writes its report and statistics
+template <typename RegistrationType>
+static void
+RunRegistration(RegistrationType& reg, const BatchJob& job, time_t start,
+                std::ostream& report)
+{
+  reg.computeBestTransform();
+  reg.printFinalReport();
+  time_t end = time(NULL);
+  report << "End of registration. Total time (s) : " << end - start << std::endl;
+
+  if (!job.statsPath.empty())
+  {
+    std::ofstream file(job.statsPath);
+    reg.printStats(file);
+    if (!file) throw std::runtime_error("Error while writing " + job.statsPath);
+  }
+}
+
+/* Prepares, in parallel, every stem map once per RANSACtol used with it,
+   with triplets only for the jobs needing them, see PreparesTriplets.
+   With a cache directory, the maps are loaded here instead, and restored
+   from the cache if they are in it, see LoadPreparedStemMap. */
+void
+BatchRegistration::prepareStemMaps()
+{
+  std::vector<PrepareKey> keys;
+  for (const auto& job : this->jobs)
+  {
+    for (const std::string& path : {job.pathSource, job.pathTarget})
+    {
+      PrepareKey key(path, job.minDiam, job.options.RANSACtol,
+                     PreparesTriplets(job.options));
+      if (this->preparedMaps.count(key) != 0
+          || this->loadErrors.count(LoadKey(path, job.minDiam)) != 0)
+        continue;
+      this->preparedMaps[key] = nullptr;
+      keys.push_back(key);
+    }
+  }
+
+  std::vector<std::shared_ptr<const PreparedStemMap>> prepared(keys.size());
+  std::vector<std::string> errors(keys.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    const std::string& path = std::get<0>(keys[i]);
+    double minDiam = std::get<1>(keys[i]);
+    double RANSACtol = std::get<2>(keys[i]);
+    bool withTriplets = std::get<3>(keys[i]);
+    try
+    {
+      if (this->cacheDir.empty())
+        prepared[i] = std::make_shared<const PreparedStemMap>(
+          this->stemMaps.at(LoadKey(path, minDiam)), RANSACtol, withTriplets);
+      else
+        prepared[i] = LoadPreparedStemMap(path, minDiam, RANSACtol, this->cacheDir,
+                                          withTriplets);
+    }
+    catch (const std::exception& e)
+    {
+      errors[i] = e.what();
+    }
+  }
+  for (size_t i = 0; i < keys.size(); ++i)
+  {
+    if (!errors[i].empty())
+    {
+      this->preparedMaps.erase(keys[i]);
+      this->loadErrors[LoadKey(std::get<0>(keys[i]), std::get<1>(keys[i]))] = errors[i];
+    }
+    else
+      this->preparedMaps[keys[i]] = prepared[i];
+  }
+}
+
+/* Runs a job with nThreads threads for its own parallel loops. Its output is
+   kept in its report, so the output of concurrent jobs isn't interleaved. */
+void
+BatchRegistration::runJob(size_t indice, int nThreads)
+{
+  const BatchJob& job = this->jobs[indice];
+  std::ostringstream report;
+  omp_set_num_threads(nThreads);
+
+  try
+  {
+    RegistrationOptions options = job.options;
+    options.log = &report;
+    report << "Registration of "
+           << job.pathSource << " to " << job.pathTarget << std::endl;
+    for (const std::string& path : {job.pathTarget, job.pathSource})
+    {
+      auto error = this->loadErrors.find(LoadKey(path, job.minDiam));
+      if (error != this->loadErrors.end())
+        throw std::runtime_error(error->second);
+    }
+
+    time_t start = time(NULL);
+    bool withTriplets = PreparesTriplets(options);
+    const auto& target = this->preparedMaps.at(PrepareKey(job.pathTarget, job.minDiam,
+                                                          options.RANSACtol, withTriplets));
+    const auto& source = this->preparedMaps.at(PrepareKey(job.pathSource, job.minDiam,
+                                                          options.RANSACtol, withTriplets));
+    if (options.coarseStems > 0)
+    {
+      HierarchicalRegistration reg(target->getStemMap(), source->getStemMap(), options);
+      RunRegistration(reg, job, start, report);
+    }
+    else
+    {
+      Registration reg(target, source, options);
+      RunRegistration(reg, job, start, report);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    report << "Error: " << e.what() << std::endl;
+    this->failed[indice] = true;
+  }
+
+  if (!job.outputPath.empty())
+  {
+    std::ofstream file(job.outputPath);
+    file << report.str();
+    if (!file) this->failed[indice] = true;
+    report.str("");
+    report << "Report of " << job.pathSource << " to " << job.pathTarget
+           << (file ? " written to " : " could not be written to ")
+           << job.outputPath << std::endl;
+  }
+  this->reports[indice] = report.str();
+}
+
+// Prints the reports, in the order of the jobs.
+void
+BatchRegistration::printReports(std::ostream& out) const
+{
+  for (const auto& it : this->reports) out << it;
+}
+
+size_t
+BatchRegistration::getNumberOfFailures() const
+{
+  size_t nFailures = 0;
+  for (char it : this->failed) nFailures += it ? 1 : 0;
+  return nFailures;
+}
+
+} // namespace tlr
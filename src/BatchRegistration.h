@@ -0,0 +1,92 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef TLR_BATCHREGISTRATION_H_
+#define TLR_BATCHREGISTRATION_H_
+
+#include "Registration.h"
+#include <map>
+#include <tuple>
+
+namespace tlr
+{
+
+/* Parses the registration option at args[i], moving i past its value if it
+   has one. Returns false if it isn't an option. Shared by the command line
+   and the batch manifest. */
+bool ParseOption(const std::vector<std::string>& args, size_t& i,
+                 RegistrationOptions& options);
+
+// One line of a batch manifest
+struct BatchJob
+{
+  std::string pathSource;
+  std::string pathTarget;
+  double minDiam;
+  RegistrationOptions options;
+  std::string outputPath; // Where to write the report, stdout if empty
+  std::string statsPath; // Where to write the statistics, nowhere if empty
+};
+
+/* Reads a batch manifest. Each line is a job, with the same arguments as a
+   single registration : path_source path_target minimum_radius
+   radius_error_tol RANSAC_error_tol [options] [--output path]
+   [--stats path]. Empty lines
+   and lines starting with # are skipped. Throws std::runtime_error on
+   malformed lines. */
+std::vector<BatchJob> LoadBatchManifest(const std::string& path);
+
+/**
+ * \brief Runs many registrations in a single process
+ *
+ * Each stem map file is loaded once, and each map is prepared once per
+ * RANSACtol, no matter how many jobs use it. The jobs then run concurrently,
+ * each one using its share of the threads for its own parallel loops.
+ */
+class BatchRegistration
+{
+ public:
+  BatchRegistration(const std::vector<BatchJob>& jobs,
+                    const std::string& cacheDir = "");
+  ~BatchRegistration();
+  void run();
+  void printReports(std::ostream& out) const;
+  size_t getNumberOfFailures() const;
+
+ private:
+  typedef std::pair<std::string, double> LoadKey;  // Path, minDiam
+  // And RANSACtol, withTriplets
+  typedef std::tuple<std::string, double, double, bool> PrepareKey;
+
+  void loadStemMaps();
+  void prepareStemMaps();
+  void runJob(size_t indice, int nThreads);
+
+  std::vector<BatchJob> jobs;
+  std::string cacheDir; // See LoadPreparedStemMap, no cache if empty
+  std::map<LoadKey, StemMap> stemMaps;
+  std::map<LoadKey, std::string> loadErrors;
+  std::map<PrepareKey, std::shared_ptr<const PreparedStemMap>> preparedMaps;
+  std::vector<std::string> reports;
+  std::vector<char> failed; // Not bool, the jobs write it concurrently
+};
+
+} // namespace tlr
+#endif
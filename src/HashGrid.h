@@ -0,0 +1,76 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef TLR_HASHGRID_H_
+#define TLR_HASHGRID_H_
+
+#include <cstddef>
+
+namespace tlr
+{
+
+// Integer coordinates of a cell in the hash grids used for the lookups.
+struct GridCell
+{
+  long long x, y, z;
+  bool operator==(const GridCell& cell) const
+  {
+    return this->x == cell.x && this->y == cell.y && this->z == cell.z;
+  }
+};
+
+struct GridCellHash
+{
+  size_t operator()(const GridCell& cell) const
+  {
+    // Large primes, as in Teschner et al.'s spatial hashing
+    return (size_t)(cell.x * 73856093LL) ^ (size_t)(cell.y * 19349663LL)
+           ^ (size_t)(cell.z * 83492791LL);
+  }
+};
+
+/* Cell of a rigid transform in a grid over its rotation vector and its
+   translation, used to find the transforms which are nearly the same. */
+struct TransformCell
+{
+  long long values[6];
+  bool operator==(const TransformCell& cell) const
+  {
+    for (size_t i = 0; i < 6; ++i)
+    {
+      if (this->values[i] != cell.values[i]) return false;
+    }
+    return true;
+  }
+};
+
+struct TransformCellHash
+{
+  size_t operator()(const TransformCell& cell) const
+  {
+    size_t hash = 0;
+    for (size_t i = 0; i < 6; ++i) hash = hash*1000003 ^ (size_t)cell.values[i];
+    return hash;
+  }
+};
+
+} // namespace tlr
+#endif
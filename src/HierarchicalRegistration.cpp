@@ -0,0 +1,267 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "HierarchicalRegistration.h"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <math.h>
+#include <sstream>
+
+namespace tlr
+{
+
+// Transforms of the coarse tier checked against the next tiers
+static const size_t CoarseHypotheses = 10;
+// Rounds of matching and fitting on each tier
+static const size_t MaxRefinements = 3;
+
+// The n stems of a map with the largest radius, largest first
+static StemMap
+LargestStems(const StemMap& stemMap, size_t n)
+{
+  RadiusIndex radii(stemMap);
+  StemMap largest;
+  for (size_t rank = radii.size(); rank > 0 && largest.getStems().size() < n; --rank)
+  {
+    Stem stem = stemMap.getStems()[radii.getIndice(rank - 1)];
+    largest.addStem(stem);
+  }
+  return largest;
+}
+
+HierarchicalRegistration::HierarchicalRegistration(const StemMap& target,
+                                                   const StemMap& source,
+                                                   const RegistrationOptions& options) :
+  target(target),
+  source(source),
+  options(options)
+{
+}
+
+HierarchicalRegistration::~HierarchicalRegistration()
+{
+}
+
+void
+HierarchicalRegistration::computeBestTransform()
+{
+  std::ostream& log = *this->options.log;
+  size_t nAll = std::max(this->target.getStems().size(), this->source.getStems().size());
+  size_t nTier = this->options.coarseStems > 0 ? std::min(this->options.coarseStems, nAll)
+                                               : nAll;
+
+  this->tiers.clear();
+  auto start = std::chrono::steady_clock::now();
+  RegistrationOptions coarseOptions = this->options;
+  coarseOptions.topK = std::max(this->options.topK, CoarseHypotheses);
+  log << "Tier 1 : hypotheses from the " << nTier << " largest stems" << std::endl;
+  this->coarse.reset(new Registration(LargestStems(this->target, nTier),
+                                      LargestStems(this->source, nTier),
+                                      coarseOptions));
+  this->coarse->computeBestTransform();
+
+  std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> transforms;
+  for (const auto& it : this->coarse->getBestPairs())
+    transforms.push_back(it.getBestTransform());
+  TierStats coarseStats;
+  coarseStats.nStems = nTier;
+  coarseStats.nHypotheses = transforms.size();
+  if (!this->coarse->getBestPairs().empty())
+    coarseStats.nMatching = this->coarse->getBestPairs().front().getSourceGroup().size();
+  coarseStats.time = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                   - start).count();
+  this->tiers.push_back(coarseStats);
+
+  /* Each tier has twice as many stems as the previous one. The last one is
+     the maps themselves, so the pairs kept point to their stems. */
+  for (size_t tier = 2; !transforms.empty(); ++tier)
+  {
+    start = std::chrono::steady_clock::now();
+    nTier = std::min(2*nTier, nAll);
+    bool last = nTier == nAll;
+    StemMap targetTier = last ? StemMap() : LargestStems(this->target, nTier);
+    StemMap sourceTier = last ? StemMap() : LargestStems(this->source, nTier);
+
+    std::vector<PairOfStemGroups> pairs;
+    for (const auto& it : transforms)
+    {
+      this->refine(last ? this->target : targetTier,
+                   last ? this->source : sourceTier, it, pairs);
+    }
+    std::sort(pairs.begin(), pairs.end());
+    TierStats tierStats;
+    tierStats.nStems = nTier;
+    tierStats.nHypotheses = pairs.size();
+    tierStats.nMatching = pairs.empty() ? 0 : pairs.front().getSourceGroup().size();
+    log << "Tier " << tier << " : " << nTier << " largest stems, "
+        << tierStats.nMatching << " matching stems" << std::endl;
+
+    if (last)
+    {
+      // Hypotheses often converge to the same stems
+      this->bestPairs.clear();
+      for (const auto& it : pairs)
+      {
+        if (this->bestPairs.size() == this->options.topK) break;
+        bool duplicate = false;
+        for (const auto& kept : this->bestPairs)
+        {
+          duplicate = duplicate || (kept.getSourceGroup() == it.getSourceGroup()
+                                    && kept.getTargetGroup() == it.getTargetGroup());
+        }
+        if (!duplicate) this->bestPairs.push_back(it);
+      }
+      for (auto& it : this->bestPairs)
+      {
+        it.computeReweightedTransform(this->options.RANSACtol,
+                                      this->options.refineIterations,
+                                      !NeedsTriplets(this->options));
+      }
+    }
+    tierStats.time = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                   - start).count();
+    this->tiers.push_back(tierStats);
+    if (last) break;
+    transforms.clear();
+    for (const auto& it : pairs) transforms.push_back(it.getBestTransform());
+  }
+}
+
+/* Finds the stems of source which, moved by transform, are within RANSACtol
+   of a stem of target with a corresponding diameter, like
+   Registration::RANSACtransform, each matched to the nearest such stem not
+   matched yet. The transform is fitted again to these
+   matches and the search repeated until they don't change. Appends the
+   resulting pair to pairs, unless too few stems match to fit a transform. */
+bool
+HierarchicalRegistration::refine(const StemMap& target, const StemMap& source,
+                                 const Eigen::Matrix4d& transform,
+                                 std::vector<PairOfStemGroups>& pairs) const
+{
+  const auto& targetStems = target.getStems();
+  const auto& sourceStems = source.getStems();
+  size_t minStems = NeedsTriplets(this->options) ? 3 : 2;
+  StemGrid grid(target, this->options.RANSACtol);
+  std::vector<size_t> neighbours;
+  Eigen::Matrix4d current = transform;
+  StemGroup targetGroup;
+  StemGroup sourceGroup;
+
+  for (size_t round = 0; round < MaxRefinements; ++round)
+  {
+    StemGroup previous = sourceGroup;
+    std::vector<bool> targetMatched(targetStems.size(), false);
+    targetGroup.clear();
+    sourceGroup.clear();
+    for (const auto& it : sourceStems)
+    {
+      neighbours.clear();
+      Eigen::Vector4d moved = current*it.getCoords();
+      grid.findNeighbours(moved, neighbours);
+      size_t nearest = targetStems.size();
+      double nearestDistance = std::numeric_limits<double>::max();
+      for (size_t j : neighbours)
+      {
+        const Stem& other = targetStems[j];
+        double distance = (other.getCoords() - moved).norm();
+        if (!targetMatched[j] && distance < nearestDistance
+            && !(fabs(other.getRadius() - it.getRadius()) /
+                 ((other.getRadius() + it.getRadius())/2) > this->options.diamErrorTol))
+        {
+          nearest = j;
+          nearestDistance = distance;
+        }
+      }
+      if (nearest < targetStems.size())
+      {
+        targetGroup.push_back(&targetStems[nearest]);
+        sourceGroup.push_back(&it);
+        targetMatched[nearest] = true;
+      }
+    }
+    if (sourceGroup.size() < minStems) return false;
+
+    /* The pair is built from the first match, the others are added after
+       since the constructor sorts each group by radius on its own. */
+    PairOfStemGroups pair({targetGroup[0]}, {sourceGroup[0]});
+    for (size_t i = 1; i < sourceGroup.size(); ++i)
+      pair.addFittingStem(sourceGroup[i], targetGroup[i]);
+    if (NeedsTriplets(this->options))
+      current = pair.computeBestTransform();
+    else
+      current = pair.computeBestYawTransform();
+
+    if (sourceGroup == previous || round + 1 == MaxRefinements)
+    {
+      pairs.push_back(pair);
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+HierarchicalRegistration::printFinalReport()
+{
+  PrintBestPairs(*this->options.log, this->bestPairs);
+}
+
+/* Statistics of every tier, the first one with those of its registration,
+   see Registration::printStats */
+void
+HierarchicalRegistration::printStats(std::ostream& out) const
+{
+  out << "{" << std::endl;
+  if (this->coarse)
+  {
+    std::ostringstream coarseStats;
+    this->coarse->printStats(coarseStats);
+    std::string text = coarseStats.str();
+    text.pop_back();
+    out << "  \"coarse\": ";
+    for (char c : text)
+    {
+      out << c;
+      if (c == '\n') out << "  ";
+    }
+    out << "," << std::endl;
+  }
+  out << "  \"tiers\": [";
+  for (size_t i = 0; i < this->tiers.size(); ++i)
+  {
+    const TierStats& it = this->tiers[i];
+    out << (i == 0 ? "" : ",") << std::endl
+        << "    {\"tier\": " << i + 1
+        << ", \"stems\": " << it.nStems
+        << ", \"hypotheses\": " << it.nHypotheses
+        << ", \"matching_stems\": " << it.nMatching
+        << ", \"time_s\": " << it.time << "}";
+  }
+  out << std::endl << "  ]" << std::endl
+      << "}" << std::endl;
+}
+
+const std::vector<PairOfStemGroups>&
+HierarchicalRegistration::getBestPairs() const
+{
+  return this->bestPairs;
+}
+
+} // namespace tlr
@@ -0,0 +1,74 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef TLR_HIERARCHICALREGISTRATION_H_
+#define TLR_HIERARCHICALREGISTRATION_H_
+
+#include "Registration.h"
+
+namespace tlr
+{
+
+/**
+ * \brief Coarse to fine registration over tiers of stems sorted by DBH
+ *
+ * The hypotheses come from a Registration of the options.coarseStems
+ * largest stems of each map only, which are the most reliably detected.
+ * Its best transforms are then checked against tiers of twice as many
+ * stems each time, down to every stem of the maps : at each tier the
+ * stems matching under the transform are found and the transform is fitted
+ * again to them. The combinatorial work is done on the coarse tier, while
+ * the final transform uses every stem.
+ */
+// What each tier of a HierarchicalRegistration did, see printStats
+struct TierStats
+{
+  size_t nStems = 0;      // Largest stems of each map in the tier
+  size_t nHypotheses = 0; // Transforms coming out of the tier
+  size_t nMatching = 0;   // Matching stems of the best of them
+  double time = 0;        // Seconds
+};
+
+class HierarchicalRegistration
+{
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  HierarchicalRegistration(const StemMap& target, const StemMap& source,
+                           const RegistrationOptions& options);
+  ~HierarchicalRegistration();
+  void computeBestTransform();
+  void printFinalReport();
+  void printStats(std::ostream& out) const;
+  const std::vector<PairOfStemGroups>& getBestPairs() const;
+
+ private:
+  bool refine(const StemMap& target, const StemMap& source,
+              const Eigen::Matrix4d& transform,
+              std::vector<PairOfStemGroups>& pairs) const;
+
+  StemMap target;
+  StemMap source;
+  RegistrationOptions options;
+  std::unique_ptr<Registration> coarse;
+  std::vector<PairOfStemGroups> bestPairs; // options.topK best, best first
+  std::vector<TierStats> tiers;
+};
+
+} // namespace tlr
+#endif
@@ -0,0 +1,120 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include "MappedFile.h"
+#include <stdexcept>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace tlr
+{
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path) :
+  data(nullptr),
+  size(0),
+  file(INVALID_HANDLE_VALUE),
+  mapping(nullptr)
+{
+  this->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (this->file == INVALID_HANDLE_VALUE)
+    throw std::runtime_error(path + ": can't open file");
+
+  LARGE_INTEGER fileSize;
+  GetFileSizeEx(this->file, &fileSize);
+  this->size = (size_t)fileSize.QuadPart;
+  if (this->size == 0) return; // Nothing to map
+
+  this->mapping = CreateFileMappingA(this->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (this->mapping != nullptr)
+    this->data = (const char*)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (this->data == nullptr)
+  {
+    if (this->mapping != nullptr) CloseHandle(this->mapping);
+    CloseHandle(this->file);
+    throw std::runtime_error(path + ": can't map file");
+  }
+}
+
+MappedFile::~MappedFile()
+{
+  if (this->data != nullptr) UnmapViewOfFile(this->data);
+  if (this->mapping != nullptr) CloseHandle(this->mapping);
+  CloseHandle(this->file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) :
+  data(nullptr),
+  size(0)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error(path + ": can't open file");
+
+  struct stat status;
+  if (fstat(fd, &status) != 0)
+  {
+    close(fd);
+    throw std::runtime_error(path + ": can't read file size");
+  }
+  this->size = (size_t)status.st_size;
+  if (this->size > 0) // mmap refuses empty mappings
+  {
+    void* mapped = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED)
+    {
+      close(fd);
+      throw std::runtime_error(path + ": can't map file");
+    }
+    this->data = (const char*)mapped;
+  }
+  close(fd); // The mapping stays valid
+}
+
+MappedFile::~MappedFile()
+{
+  if (this->data != nullptr) munmap((void*)this->data, this->size);
+}
+
+#endif
+
+const char*
+MappedFile::getData() const
+{
+  return this->data;
+}
+
+size_t
+MappedFile::getSize() const
+{
+  return this->size;
+}
+
+} // namespace tlr
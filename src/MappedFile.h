@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef TLR_MAPPEDFILE_H_
+#define TLR_MAPPEDFILE_H_
+
+#include <string>
+
+namespace tlr
+{
+
+/**
+ * \brief Read-only memory mapping of a whole file
+ *
+ * The file stays mapped as long as the object lives. Throws
+ * std::runtime_error if the file can't be opened or mapped.
+ */
+class MappedFile
+{
+ public:
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  const char* getData() const;
+  size_t getSize() const;
+
+ private:
+  const char* data;
+  size_t size;
+#ifdef _WIN32
+  void* file;
+  void* mapping;
+#endif
+};
+
+} // namespace tlr
+#endif
@@ -0,0 +1,331 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "MultiScanRegistration.h"
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <math.h>
+#include <omp.h>
+
+namespace tlr
+{
+
+// A registration found by a single triplet is not trusted
+static const size_t MinStemsPerPair = 4;
+
+/* Histogram of the radii of a map, with bins as wide as the diameter
+   tolerance on a logarithmic scale. */
+static std::map<long long, size_t>
+RadiusHistogram(const StemMap& stemMap, double diamErrorTol)
+{
+  double binWidth = log(1 + std::max(diamErrorTol, 0.01));
+  std::map<long long, size_t> histogram;
+  for (const auto& it : stemMap.getStems())
+  {
+    if (it.getRadius() > 0) ++histogram[(long long)floor(log(it.getRadius()) / binWidth)];
+  }
+  return histogram;
+}
+
+// Root mean square horizontal distance of the stems to their centroid.
+static double
+HorizontalSpread(const StemMap& stemMap)
+{
+  const auto& stems = stemMap.getStems();
+  if (stems.empty()) return 0;
+  Eigen::Vector2d centroid = Eigen::Vector2d::Zero();
+  for (const auto& it : stems) centroid += it.getCoords().head<2>();
+  centroid /= stems.size();
+  double sum = 0;
+  for (const auto& it : stems) sum += (it.getCoords().head<2>() - centroid).squaredNorm();
+  return sqrt(sum / stems.size());
+}
+
+/* Rough number of stems two scans have in common, without registering them.
+   The shared part of their diameter distributions bounds the number of
+   common stems. It is scaled by the ratio of the areas the scans cover,
+   since a scan can only overlap a much smaller one on a small part of it.
+   Only the ranking of the pairs matters. */
+double
+EstimateOverlap(const StemMap& stemMap1, const StemMap& stemMap2,
+                double diamErrorTol)
+{
+  std::map<long long, size_t> histogram1 = RadiusHistogram(stemMap1, diamErrorTol);
+  std::map<long long, size_t> histogram2 = RadiusHistogram(stemMap2, diamErrorTol);
+  double shared = 0;
+  for (const auto& it : histogram1)
+  {
+    auto other = histogram2.find(it.first);
+    if (other != histogram2.end()) shared += std::min(it.second, other->second);
+  }
+
+  double spread1 = HorizontalSpread(stemMap1);
+  double spread2 = HorizontalSpread(stemMap2);
+  if (std::max(spread1, spread2) <= 0) return shared;
+  double ratio = std::min(spread1, spread2) / std::max(spread1, spread2);
+  return shared*ratio*ratio;
+}
+
+MultiScanRegistration::MultiScanRegistration(const std::vector<std::string>& names,
+                                             const std::vector<std::shared_ptr<const PreparedStemMap>>& stemMaps,
+                                             const RegistrationOptions& options,
+                                             size_t nPairs) :
+  names(names),
+  stemMaps(stemMaps),
+  options(options),
+  nPairs(nPairs),
+  graph(stemMaps.size()),
+  maxAngle(M_PI),
+  nInconsistent(0)
+{
+  // By default a spanning tree plus half as many pairs to close loops
+  size_t nScans = stemMaps.size();
+  if (this->nPairs == 0 && nScans > 1)
+    this->nPairs = (nScans - 1) + nScans/2;
+
+  if (options.coarseStems > 0)
+    throw std::invalid_argument("Hierarchical registration isn't supported with several scans");
+  for (const auto& it : stemMaps)
+  {
+    if (it->getRANSACtol() != options.RANSACtol)
+      throw std::invalid_argument("Stem maps prepared for another RANSAC tolerance");
+  }
+}
+
+MultiScanRegistration::~MultiScanRegistration()
+{
+}
+
+void
+MultiScanRegistration::run()
+{
+  this->scorePairs();
+  this->registerPairs(this->selectPairs());
+  this->connectScans();
+  this->nInconsistent = this->graph.removeInconsistentEdges(2*this->options.RANSACtol,
+                                                            this->maxAngle);
+}
+
+// Estimates the overlap of every pair of scans and ranks them.
+void
+MultiScanRegistration::scorePairs()
+{
+  // Around the center of each map, so it doesn't depend on the scan origin
+  double farthest = 0;
+  for (const auto& map : this->stemMaps)
+  {
+    const auto& stems = map->getStems();
+    if (stems.empty()) continue;
+    Eigen::Vector3d center = Eigen::Vector3d::Zero();
+    for (const auto& it : stems) center += it.getCoords().head<3>();
+    center /= stems.size();
+    for (const auto& it : stems)
+      farthest = std::max(farthest, (it.getCoords().head<3>() - center).norm());
+  }
+  if (farthest > 0)
+    this->maxAngle = std::min(M_PI, 2*this->options.RANSACtol / farthest);
+
+  this->pairs.clear();
+  for (size_t target = 0; target < this->stemMaps.size(); ++target)
+  {
+    for (size_t source = target + 1; source < this->stemMaps.size(); ++source)
+    {
+      ScanPair pair;
+      pair.source = source;
+      pair.target = target;
+      pair.overlap = EstimateOverlap(this->stemMaps[source]->getStemMap(),
+                                     this->stemMaps[target]->getStemMap(),
+                                     this->options.diamErrorTol);
+      pair.tried = false;
+      pair.edge = std::numeric_limits<size_t>::max();
+      pair.nStems = 0;
+      pair.meanSquareError = 0;
+      this->pairs.push_back(pair);
+    }
+  }
+  // Stable so that equal overlaps keep the order of the scans
+  std::stable_sort(this->pairs.begin(), this->pairs.end(),
+                   [](const ScanPair& left, const ScanPair& right) -> bool
+                   {
+                     return left.overlap > right.overlap;
+                   });
+}
+
+/* The maximum overlap spanning tree of the scans (Kruskal), then the best
+   remaining pairs until there are nPairs of them. Each of those closes a
+   loop, which lets the pose graph check the registrations. */
+std::vector<size_t>
+MultiScanRegistration::selectPairs() const
+{
+  std::vector<size_t> components(this->stemMaps.size());
+  for (size_t i = 0; i < components.size(); ++i) components[i] = i;
+  auto root = [&components](size_t node) -> size_t
+  {
+    while (components[node] != node) node = components[node];
+    return node;
+  };
+
+  std::vector<size_t> selected;
+  std::vector<bool> inTree(this->pairs.size(), false);
+  for (size_t i = 0; i < this->pairs.size(); ++i)
+  {
+    size_t a = root(this->pairs[i].source);
+    size_t b = root(this->pairs[i].target);
+    if (a == b) continue;
+    components[std::max(a, b)] = std::min(a, b);
+    selected.push_back(i);
+    inTree[i] = true;
+  }
+  for (size_t i = 0; i < this->pairs.size() && selected.size() < this->nPairs; ++i)
+  {
+    if (!inTree[i]) selected.push_back(i);
+  }
+  std::sort(selected.begin(), selected.end());
+  return selected;
+}
+
+/* Registers the selected pairs, concurrently like BatchRegistration, and
+   adds the successful ones to the pose graph in the order of the pairs. */
+void
+MultiScanRegistration::registerPairs(const std::vector<size_t>& selected)
+{
+  if (selected.empty()) return;
+  std::vector<Eigen::Matrix<double, 4, 4, Eigen::DontAlign>> transforms(selected.size());
+  std::vector<Eigen::Matrix<double, 3, 1, Eigen::DontAlign>> centers(selected.size());
+
+  int nThreads = omp_get_max_threads();
+  int nConcurrent = std::min((int)selected.size(), nThreads);
+  int nThreadsPerPair = std::max(1, nThreads / nConcurrent);
+  omp_set_max_active_levels(2);
+
+  #pragma omp parallel for schedule(dynamic) num_threads(nConcurrent)
+  for (size_t i = 0; i < selected.size(); ++i)
+  {
+    ScanPair& pair = this->pairs[selected[i]];
+    std::ostringstream log; // The progress of each registration isn't shown
+    RegistrationOptions options = this->options;
+    options.log = &log;
+    omp_set_num_threads(nThreadsPerPair);
+
+    pair.tried = true;
+    // An exception can't leave the parallel loop, the pair only fails
+    try
+    {
+      Registration reg(this->stemMaps[pair.target], this->stemMaps[pair.source], options);
+      reg.computeBestTransform();
+      if (reg.getBestPairs().empty()) continue;
+      const PairOfStemGroups& best = reg.getBestPairs().front();
+      pair.nStems = best.getTargetGroup().size();
+      pair.meanSquareError = best.getMeanSquareError();
+      transforms[i] = best.getBestTransform();
+      Eigen::Vector3d center;
+      GetCentroid(best.getSourceGroup(), center);
+      centers[i] = center;
+    }
+    catch (const std::exception& e)
+    {
+      pair.nStems = 0;
+      pair.error = e.what();
+    }
+  }
+
+  for (size_t i = 0; i < selected.size(); ++i)
+  {
+    ScanPair& pair = this->pairs[selected[i]];
+    if (pair.nStems < MinStemsPerPair) continue;
+    pair.edge = this->graph.getEdges().size();
+    this->graph.addEdge(pair.source, pair.target, transforms[i], pair.nStems, centers[i]);
+  }
+}
+
+/* If registrations failed and left scans apart, registers the best untried
+   pair joining two groups of scans, until they are all connected or no
+   such pair is left. */
+void
+MultiScanRegistration::connectScans()
+{
+  while (!this->graph.isConnected())
+  {
+    std::vector<size_t> components = this->graph.findComponents();
+    size_t next = this->pairs.size();
+    for (size_t i = 0; i < this->pairs.size() && next == this->pairs.size(); ++i)
+    {
+      const ScanPair& pair = this->pairs[i];
+      if (!pair.tried && components[pair.source] != components[pair.target]) next = i;
+    }
+    if (next == this->pairs.size()) return;
+    this->registerPairs({next});
+  }
+}
+
+void
+MultiScanRegistration::printReport(std::ostream& out) const
+{
+  size_t nTried = 0;
+  for (const auto& it : this->pairs) nTried += it.tried ? 1 : 0;
+  out << "====== Multi-scan registration ======" << std::endl
+      << "Registered " << nTried << " of " << this->pairs.size()
+      << " pairs of scans. " << std::endl
+      << "Inconsistent registrations removed: " << this->nInconsistent << std::endl
+      << "------ Registered pairs ------" << std::endl;
+  for (const auto& it : this->pairs)
+  {
+    if (!it.tried) continue;
+    out << this->names[it.source] << " to " << this->names[it.target] << " : ";
+    if (it.edge == std::numeric_limits<size_t>::max())
+    {
+      out << "failed" << (it.error.empty() ? "" : ": " + it.error) << std::endl;
+      continue;
+    }
+    out << it.nStems << " stems, MSE " << it.meanSquareError;
+    // Without poses, the residual would be against the identity
+    if (!this->graph.isPlaced(it.source) || !this->graph.isPlaced(it.target))
+    {
+      out << ", not placed" << std::endl;
+      continue;
+    }
+    double distance, angle;
+    this->graph.edgeResidual(it.edge, distance, angle);
+    out << ", loop residual " << distance << " m " << angle*180/M_PI << " deg"
+        << (this->graph.getEdges()[it.edge].enabled ? "" : ", inconsistent")
+        << std::endl;
+  }
+
+  out << "------ Poses in the frame of " << this->names[0] << " ------" << std::endl;
+  for (size_t i = 0; i < this->names.size(); ++i)
+  {
+    out << "---- " << this->names[i] << " ----" << std::endl;
+    if (this->graph.isPlaced(i))
+      out << this->graph.getPose(i) << std::endl;
+    else
+      out << "Not connected to the other scans" << std::endl;
+  }
+}
+
+const PoseGraph&
+MultiScanRegistration::getPoseGraph() const
+{
+  return this->graph;
+}
+
+} // namespace tlr
@@ -0,0 +1,84 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef TLR_MULTISCANREGISTRATION_H_
+#define TLR_MULTISCANREGISTRATION_H_
+
+#include "Registration.h"
+#include "PoseGraph.h"
+
+namespace tlr
+{
+
+double EstimateOverlap(const StemMap& stemMap1, const StemMap& stemMap2,
+                       double diamErrorTol);
+
+/**
+ * \brief Registers the scans of a plot together
+ *
+ * Instead of registering every pair of scans, the pairs are ranked by their
+ * estimated overlap (see EstimateOverlap) and only the best ones are
+ * registered : a spanning tree, so every scan is reached, plus a few more
+ * to close loops. A PoseGraph then places every scan in the frame of the
+ * first one and disables the registrations which disagree with the others.
+ */
+class MultiScanRegistration
+{
+ public:
+  MultiScanRegistration(const std::vector<std::string>& names,
+                        const std::vector<std::shared_ptr<const PreparedStemMap>>& stemMaps,
+                        const RegistrationOptions& options,
+                        size_t nPairs = 0);
+  ~MultiScanRegistration();
+  void run();
+  void printReport(std::ostream& out) const;
+  const PoseGraph& getPoseGraph() const;
+
+ private:
+  // Two scans, the source being registered to the target.
+  struct ScanPair
+  {
+    size_t source;
+    size_t target;
+    double overlap;
+    bool tried;
+    size_t edge; // In the pose graph, the largest size_t if it failed
+    size_t nStems;
+    double meanSquareError;
+    std::string error; // Why the registration failed, empty if it ran
+  };
+
+  void scorePairs();
+  std::vector<size_t> selectPairs() const;
+  void registerPairs(const std::vector<size_t>& selected);
+  void connectScans();
+
+  std::vector<std::string> names;
+  std::vector<std::shared_ptr<const PreparedStemMap>> stemMaps;
+  RegistrationOptions options;
+  size_t nPairs; // Number of pairs to register, unless more are needed
+  std::vector<ScanPair> pairs; // Every pair of scans, best overlap first
+  PoseGraph graph;
+  double maxAngle; // Rotation moving the farthest stem by 2*RANSACtol
+  size_t nInconsistent;
+};
+
+} // namespace tlr
+#endif
@@ -25,15 +25,18 @@
 namespace tlr
 {
 
-PairOfStemGroups::PairOfStemGroups(StemGroup& targetTriplet,
-                                   StemGroup& sourceTriplet) :
+PairOfStemGroups::PairOfStemGroups(const StemGroup& targetTriplet,
+                                   const StemGroup& sourceTriplet) :
   targetGroup(targetTriplet),
   sourceGroup(sourceTriplet),
   bestTransform(Eigen::Matrix4d::Identity()),
-  transformComputed(false)
+  transformComputed(false),
+  support(0)
 {
   this->sortStems();
   this->updateRadiusSimilarity();
+  this->resetSums();
+  for (size_t i = 0; i < this->sourceGroup.size(); ++i) this->addToSums(i, 1);
 }
 
 
@@ -41,6 +44,14 @@ PairOfStemGroups::~PairOfStemGroups()
 {
 }
 
+// Relative error of diameter between two corresponding stems
+static double
+RadiusError(const Stem* sourceStem, const Stem* targetStem)
+{
+  return fabs(sourceStem->getRadius() - targetStem->getRadius())
+         /((sourceStem->getRadius() + targetStem->getRadius())/2);
+}
+
 /*
   After running the registration using the least square, the registration class
   will determine if another stem is common to the two maps. If so we'll add it
@@ -53,8 +64,8 @@ PairOfStemGroups::addFittingStem(const Stem* sourceStem, const Stem* targetStem)
   this->sourceGroup.push_back(sourceStem);
   this->targetGroup.push_back(targetStem);
   // Update attributes
-  // this->sortStems();
-  this->updateRadiusSimilarity();
+  this->radiusSimilarity.push_back(RadiusError(sourceStem, targetStem));
+  this->addToSums(this->sourceGroup.size() - 1, 1);
 }
 
 // Return the previously computed best transform
@@ -64,56 +75,134 @@ PairOfStemGroups::getBestTransform() const
   return this->bestTransform;
 }
 
-// Compute the best transform between the pair and returns it
+/* Compute the best transform between the pair and returns it. This is the
+   least square solution of Arun et al. It only needs the running sums of
+   the stems, the cross-covariance matrix being always 3x3 whatever the
+   number of stems : there is no heap allocation and no loop over the stems,
+   which matters since this runs several times per candidate pair. */
 Eigen::Matrix4d
 PairOfStemGroups::computeBestTransform()
 {
-  // Declarations
+  return this->solve(false);
+}
+
+/* Least square transform restricted to a rotation about z and a translation,
+   for levelled scans. The angle minimizing the error of the centered points
+   has a closed form : the atan2 of the sums of the cross and dot products of
+   their horizontal coordinates. Two stems are enough to determine it. */
+Eigen::Matrix4d
+PairOfStemGroups::computeBestYawTransform()
+{
+  return this->solve(true);
+}
+
+/* Iteratively reweighted least squares, to lower the influence of the wrong
+   matches a pair may have picked up. Each stem is weighted by the Cauchy
+   weight of its residual under the current transform, then the transform is
+   solved again. The mean square error stays unweighted. */
+Eigen::Matrix4d
+PairOfStemGroups::computeReweightedTransform(double scale, size_t nIterations,
+                                             bool yawOnly)
+{
+  if (!this->transformComputed) this->solve(yawOnly);
+  for (size_t iteration = 0; iteration < nIterations; ++iteration)
+  {
+    Eigen::Matrix4d transform = this->bestTransform;
+    this->resetSums();
+    for (size_t i = 0; i < this->sourceGroup.size(); ++i)
+    {
+      double residual = (this->targetGroup[i]->getCoords()
+                         - transform*this->sourceGroup[i]->getCoords()).norm() / scale;
+      this->addToSums(i, 1/(1 + residual*residual));
+    }
+    this->solve(yawOnly);
+  }
+
+  this->resetSums();
+  for (size_t i = 0; i < this->sourceGroup.size(); ++i) this->addToSums(i, 1);
+  this->updateMeanSquareError();
+  return this->bestTransform;
+}
+
+// Transform minimizing the weighted square error, see computeBestTransform
+Eigen::Matrix4d
+PairOfStemGroups::solve(bool yawOnly)
+{
   Eigen::Vector3d pbar;
   Eigen::Vector3d qbar;
-  Eigen::MatrixXd X;
-  Eigen::MatrixXd Yt;
-  Eigen::MatrixXd S;
-  Eigen::MatrixXd matricePourTrouverR;
-  Eigen::MatrixXd matricePourSavoirDet;
+  Eigen::Matrix3d S;
   Eigen::Matrix3d R;
-  Eigen::Vector3d t;
-
-  // Compute the centroids
-  GetCentroid(this->targetGroup, qbar);
-  GetCentroid(this->sourceGroup, pbar);
+  this->getCentered(pbar, qbar, S);
 
-  // Center the points and generate the covariance matrix
-  X.resize(3, this->sourceGroup.size());
-  Yt.resize(this->sourceGroup.size(), 3);
-
-  for (unsigned int i = 0; i < this->sourceGroup.size(); ++i)
+  if (yawOnly)
   {
-    X(0, i)  = this->sourceGroup[i]->getCoords()(0) - pbar(0);
-    X(1, i)  = this->sourceGroup[i]->getCoords()(1) - pbar(1);
-    X(2, i)  = this->sourceGroup[i]->getCoords()(2) - pbar(2);
-    Yt(i, 0) = this->targetGroup[i]->getCoords()(0) - qbar(0);
-    Yt(i, 1) = this->targetGroup[i]->getCoords()(1) - qbar(1);
-    Yt(i, 2) = this->targetGroup[i]->getCoords()(2) - qbar(2);
+    R = Eigen::AngleAxisd(atan2(S(0, 1) - S(1, 0), S(0, 0) + S(1, 1)),
+                          Eigen::Vector3d::UnitZ()).toRotationMatrix();
   }
+  else
+  {
+    Eigen::Matrix3d matricePourTrouverR = Eigen::Matrix3d::Identity();
+    Eigen::JacobiSVD<Eigen::Matrix3d>
+    svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    matricePourTrouverR(2, 2) = (svd.matrixV()*svd.matrixU().transpose()).determinant();
+    R = svd.matrixV()*matricePourTrouverR*svd.matrixU().transpose();
+  }
+  // Back from the origins of the sums
+  Eigen::Vector3d t = qbar + this->targetOrigin - R*(pbar + this->sourceOrigin);
 
-  S = X*Yt;
-  Eigen::JacobiSVD<Eigen::MatrixXd>
-  svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
-  matricePourTrouverR = Eigen::MatrixXd::Identity(3, 3);
-  matricePourSavoirDet = svd.matrixV()*svd.matrixU().transpose();
-  matricePourTrouverR(2, 2) = matricePourSavoirDet.determinant();
-  R = svd.matrixV()*matricePourTrouverR*svd.matrixU().transpose();
-  t = qbar - R*pbar;
+  this->setBestTransform(R, t);
+  return this->bestTransform;
+}
 
-  // Generate the 4x4 transform matrix from the result
+// Generate the 4x4 transform matrix from the result
+void
+PairOfStemGroups::setBestTransform(const Eigen::Matrix3d& R, const Eigen::Vector3d& t)
+{
   this->bestTransform << R(0, 0), R(0, 1), R(0, 2), t(0),
                          R(1, 0), R(1, 1), R(1, 2), t(1),
                          R(2, 0), R(2, 1), R(2, 2), t(2),
                          0,       0,       0,       1;
   this->transformComputed = true;
   this->updateMeanSquareError();
-  return this->bestTransform;
+}
+
+// Empties the sums, with the first stems of the groups as their origins.
+void
+PairOfStemGroups::resetSums()
+{
+  this->sourceOrigin = this->sourceGroup.empty() ? Eigen::Vector3d::Zero().eval()
+                       : this->sourceGroup[0]->getCoords().head<3>().eval();
+  this->targetOrigin = this->targetGroup.empty() ? Eigen::Vector3d::Zero().eval()
+                       : this->targetGroup[0]->getCoords().head<3>().eval();
+  this->sumWeights = 0;
+  this->sumSource.setZero();
+  this->sumTarget.setZero();
+  this->sumProducts.setZero();
+  this->sumSquaredNorms = 0;
+}
+
+// Adds the indice-th corresponding stems to the sums with the given weight.
+void
+PairOfStemGroups::addToSums(size_t indice, double weight)
+{
+  Eigen::Vector3d p = this->sourceGroup[indice]->getCoords().head<3>() - this->sourceOrigin;
+  Eigen::Vector3d q = this->targetGroup[indice]->getCoords().head<3>() - this->targetOrigin;
+  this->sumWeights += weight;
+  this->sumSource += weight*p;
+  this->sumTarget += weight*q;
+  this->sumProducts.noalias() += weight*p*q.transpose();
+  this->sumSquaredNorms += weight*(p.squaredNorm() + q.squaredNorm());
+}
+
+/* The centroids of the groups, relative to the origins of the sums, and the
+   cross-covariance matrix of the centered stems. */
+void
+PairOfStemGroups::getCentered(Eigen::Vector3d& pbar, Eigen::Vector3d& qbar,
+                              Eigen::Matrix3d& S) const
+{
+  pbar = this->sumSource / this->sumWeights;
+  qbar = this->sumTarget / this->sumWeights;
+  S = this->sumProducts - this->sumWeights*pbar*qbar.transpose();
 }
 
 // Sort the stem groups by the DBH
@@ -130,11 +219,7 @@ PairOfStemGroups::updateRadiusSimilarity()
 {
   std::vector<double> result;
   for (unsigned int i = 0; i < this->sourceGroup.size(); ++i)
-  {
-    result.push_back(fabs(
-      this->sourceGroup[i]->getRadius() - this->targetGroup[i]->getRadius())
-      /((this->sourceGroup[i]->getRadius() + this->targetGroup[i]->getRadius())/2));
-  }
+    result.push_back(RadiusError(this->sourceGroup[i], this->targetGroup[i]));
   this->radiusSimilarity = result;
 }
 
@@ -145,32 +230,34 @@ PairOfStemGroups::getRadiusSimilarity() const
   return this->radiusSimilarity;
 }
 
-const StemGroup 
+const StemGroup&
 PairOfStemGroups::getTargetGroup() const
 {
   return this->targetGroup;
 }
 
-const StemGroup 
+const StemGroup&
 PairOfStemGroups::getSourceGroup() const
 {
   return this->sourceGroup;
 }
 
+/* Sum of the square errors of the stems under the best transform, from the
+   sums : with the coordinates relative to the origins, the error of a stem
+   is q - Rp - t', so its square is |p|^2 + |q|^2 + |t'|^2 - 2 q.Rp - 2 q.t'
+   + 2 Rp.t'. */
 double
 PairOfStemGroups::updateMeanSquareError()
 {
-  double MSE = 0;
-  Eigen::Vector4d stemError;
-  for (unsigned int i = 0; i < this->targetGroup.size(); ++i)
-  {
-    stemError = this->targetGroup[i]->getCoords()
-                - this->bestTransform*(this->sourceGroup[i]->getCoords());
-    MSE += pow(stemError.norm(), 2);
-  }
+  Eigen::Matrix3d R = this->bestTransform.block<3, 3>(0, 0);
+  Eigen::Vector3d t = this->bestTransform.block<3, 1>(0, 3)
+                      + R*this->sourceOrigin - this->targetOrigin;
+  double MSE = this->sumSquaredNorms + this->sumWeights*t.squaredNorm()
+               - 2*(R*this->sumProducts).trace()
+               - 2*t.dot(this->sumTarget) + 2*t.dot(R*this->sumSource);
 
-  this->meanSquareError = MSE;
-  return MSE;
+  this->meanSquareError = std::max(MSE, 0.0); // Rounding, for an exact fit
+  return this->meanSquareError;
 }
 
 double
@@ -179,6 +266,18 @@ PairOfStemGroups::getMeanSquareError() const
   return this->meanSquareError;
 }
 
+size_t
+PairOfStemGroups::getSupport() const
+{
+  return this->support;
+}
+
+void
+PairOfStemGroups::setSupport(size_t support)
+{
+  this->support = support;
+}
+
 /*
   This return a vector of length 3. Each element contains the
   difference between the length of corresponding vertice in each
@@ -187,19 +286,8 @@ PairOfStemGroups::getMeanSquareError() const
 const std::vector<double>
 PairOfStemGroups::getVerticeDifference() const
 {
-  std::vector<double> result = {};
-  Eigen::Vector4d sourceVector;
-  Eigen::Vector4d targetVector;
-
-  for (size_t i = 0; i < this->targetGroup.size(); ++i)
-  {
-    // Use the next stem, or the first on if we're at the last.
-    size_t next = i == this->targetGroup.size()-1 ? 0 : i + 1;
-    sourceVector = this->sourceGroup[i]->getCoords() - this->sourceGroup[next]->getCoords();
-    targetVector = this->targetGroup[i]->getCoords() - this->targetGroup[next]->getCoords();
-    result.push_back(fabs(sourceVector.norm() - targetVector.norm()));
-  }
-
+  std::vector<double> result(this->targetGroup.size());
+  GetVerticeDifference(this->sourceGroup, this->targetGroup, result.data());
   return result;
 }
 
@@ -207,9 +295,9 @@ PairOfStemGroups::getVerticeDifference() const
    then the pair with the lowest MSE comes first.
 */
 bool
-operator<(PairOfStemGroups& l, PairOfStemGroups& r)
+operator<(const PairOfStemGroups& l, const PairOfStemGroups& r)
 {
-  if (l.getSourceGroup().size() == r.getTargetGroup().size())
+  if (l.getSourceGroup().size() == r.getSourceGroup().size())
     return l.getMeanSquareError() < r.getMeanSquareError();
   else
     return l.getSourceGroup().size() > r.getSourceGroup().size();
@@ -217,24 +305,45 @@ operator<(PairOfStemGroups& l, PairOfStemGroups& r)
 
 // Compute the "average" point of a group of stems. Used in the least square solving.
 void
-GetCentroid(const StemGroup group, Eigen::Vector3d& centroid)
+GetCentroid(const StemGroup& group, Eigen::Vector3d& centroid)
 {
   centroid << 0, 0, 0;
   for (auto& it : group)
   {
-    centroid(0) += it->getCoords()(0);
-    centroid(1) += it->getCoords()(1);
-    centroid(2) += it->getCoords()(2);
+    centroid += it->getCoords().head<3>();
+  }
+  centroid /= double(group.size());
+}
+
+/* Fills differences (one element per stem) with the difference between the
+   length of corresponding vertices in each group. Doesn't allocate, so it can
+   be used on triplets before building a pair from them. */
+void
+GetVerticeDifference(const StemGroup& sourceGroup, const StemGroup& targetGroup,
+                     double* differences)
+{
+  Eigen::Vector4d sourceVector;
+  Eigen::Vector4d targetVector;
+
+  for (size_t i = 0; i < targetGroup.size(); ++i)
+  {
+    // Use the next stem, or the first on if we're at the last.
+    size_t next = i == targetGroup.size()-1 ? 0 : i + 1;
+    sourceVector = sourceGroup[i]->getCoords() - sourceGroup[next]->getCoords();
+    targetVector = targetGroup[i]->getCoords() - targetGroup[next]->getCoords();
+    differences[i] = fabs(sourceVector.norm() - targetVector.norm());
   }
-  centroid = (float(1) / float(group.size()))*centroid;
 }
 
 /* This is an auxilliary function to sort the vector of stems using
-   the DBH */
+   the DBH. Stems of equal DBH are sorted by their position in the map, like
+   in RadiusIndex, so the order never depends on the sorting algorithm. */
 bool
 SortStemPointers(const Stem* stem1, const Stem* stem2)
 {
-  return stem1->getRadius() < stem2->getRadius();
+  if (stem1->getRadius() != stem2->getRadius())
+    return stem1->getRadius() < stem2->getRadius();
+  return stem1 < stem2;
 }
 
 } // namespace tlr
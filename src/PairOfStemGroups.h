@@ -28,31 +28,45 @@ namespace tlr
 
 typedef std::vector<const Stem*> StemGroup;
 // Helper functions declarations
-void GetCentroid(const StemGroup group,
+void GetCentroid(const StemGroup& group,
                  Eigen::Vector3d& centroid);
 bool SortStemPointers(const Stem* stem1, const Stem* stem2);
+void GetVerticeDifference(const StemGroup& sourceGroup,
+                          const StemGroup& targetGroup, double* differences);
 
 class PairOfStemGroups
 {
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW // Fixes wierd memory crashes
-  PairOfStemGroups(StemGroup& targetTriplet, StemGroup& sourceTriplet);
+  PairOfStemGroups(const StemGroup& targetTriplet, const StemGroup& sourceTriplet);
   ~PairOfStemGroups();
   const std::vector<double>& getRadiusSimilarity() const;
   const std::vector<double> getVerticeDifference() const;
   Eigen::Matrix4d computeBestTransform();
+  Eigen::Matrix4d computeBestYawTransform();
   Eigen::Matrix4d getBestTransform() const;
-  const StemGroup getTargetGroup() const;
-  const StemGroup getSourceGroup() const;
+  const StemGroup& getTargetGroup() const;
+  const StemGroup& getSourceGroup() const;
   void addFittingStem(const Stem* sourceStem, const Stem* targetStem);
+  Eigen::Matrix4d computeReweightedTransform(double scale, size_t nIterations,
+                                             bool yawOnly);
   // To sort by likelihood, and if the transform is computed sort by MSE
-  friend bool operator<(PairOfStemGroups& l, PairOfStemGroups& r);
+  friend bool operator<(const PairOfStemGroups& l, const PairOfStemGroups& r);
   double getMeanSquareError() const;
+  // Number of hypotheses with nearly the same first transform, 0 if not counted
+  size_t getSupport() const;
+  void setSupport(size_t support);
 
  private:
   void sortStems();
   void updateRadiusSimilarity();
   double updateMeanSquareError();
+  void setBestTransform(const Eigen::Matrix3d& R, const Eigen::Vector3d& t);
+  void resetSums();
+  void addToSums(size_t indice, double weight);
+  void getCentered(Eigen::Vector3d& pbar, Eigen::Vector3d& qbar,
+                   Eigen::Matrix3d& S) const;
+  Eigen::Matrix4d solve(bool yawOnly);
   /* They are only triplet at first. We'll add other stems that fit the model later.
   These are a copy of the vector created by the Registration class. We need to copy them
   because differents pair will generate different models, which means in some case we we'll have
@@ -66,11 +80,25 @@ class PairOfStemGroups
   /* They should be real but I put a complex type this way the
   compiler won't complain */
   std::vector<double> radiusSimilarity;
-  /* This is sadly necessary because of alignement issues in Eigen. Declaring
-  the transorm matrix as dynamically sized instead of 4x4 fixes bugs with matrix
-  operations in MSVSC++ 2013 */
-  Eigen::MatrixXd bestTransform;
+  /* Unaligned because of alignement issues in Eigen. An aligned 4x4 matrix
+  causes bugs with matrix operations in MSVSC++ 2013 when the pairs are stored
+  in a std::vector. It used to be dynamically sized, which meant one more heap
+  allocation per pair. */
+  Eigen::Matrix<double, 4, 4, Eigen::DontAlign> bestTransform;
   bool transformComputed;
+  /* Weighted sums over the corresponding stems, so a stem is added in
+  constant time and the transform is solved without going over
+  the stems. The coordinates are taken relative to the first stem of each
+  group, which keeps the sums small even with georeferenced coordinates.
+  The weights are 1 except during computeReweightedTransform. */
+  Eigen::Vector3d sourceOrigin;
+  Eigen::Vector3d targetOrigin;
+  double sumWeights;
+  Eigen::Vector3d sumSource;
+  Eigen::Vector3d sumTarget;
+  Eigen::Matrix3d sumProducts; // Of the source by the transposed target
+  double sumSquaredNorms;      // Of both
+  size_t support;
 };
 
 } // namespace tlr
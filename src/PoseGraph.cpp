@@ -0,0 +1,251 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "PoseGraph.h"
+#include <algorithm>
+#include <math.h>
+
+namespace tlr
+{
+
+// Number of connected components, given the labels of PoseGraph::findComponents
+static size_t
+CountComponents(const std::vector<size_t>& components)
+{
+  size_t nComponents = 0;
+  for (size_t node = 0; node < components.size(); ++node)
+    nComponents += components[node] == node ? 1 : 0;
+  return nComponents;
+}
+
+PoseGraph::PoseGraph(size_t nNodes) :
+  nNodes(nNodes),
+  poses(nNodes, Eigen::Matrix4d::Identity()),
+  placed(nNodes, false)
+{
+}
+
+void
+PoseGraph::addEdge(size_t source, size_t target, const Eigen::Matrix4d& transform,
+                   double weight, const Eigen::Vector3d& center)
+{
+  PoseGraphEdge edge;
+  edge.source = source;
+  edge.target = target;
+  edge.transform = transform;
+  edge.weight = weight;
+  edge.center = center;
+  edge.enabled = true;
+  this->edges.push_back(edge);
+}
+
+/* Computes the poses of the scans connected to the first one. Each
+   iteration replaces the pose of every scan, in turn, by the one closest to
+   the poses its neighbours predict : the weighted mean of their translations
+   and the rotation nearest to the weighted sum of their rotations. */
+void
+PoseGraph::solve(size_t maxIterations)
+{
+  this->initializePoses();
+
+  for (size_t iteration = 0; iteration < maxIterations; ++iteration)
+  {
+    double change = 0;
+    for (size_t node = 1; node < this->nNodes; ++node)
+    {
+      if (!this->placed[node]) continue;
+
+      Eigen::Matrix3d rotationSum = Eigen::Matrix3d::Zero();
+      Eigen::Vector3d translationSum = Eigen::Vector3d::Zero();
+      double weightSum = 0;
+      for (const auto& edge : this->edges)
+      {
+        if (!edge.enabled || (edge.source != node && edge.target != node)) continue;
+        Eigen::Matrix4d prediction = this->predictPose(edge, node);
+        rotationSum += edge.weight*prediction.block<3, 3>(0, 0);
+        translationSum += edge.weight*prediction.block<3, 1>(0, 3);
+        weightSum += edge.weight;
+      }
+      if (weightSum <= 0) continue;
+
+      Eigen::JacobiSVD<Eigen::Matrix3d>
+      svd(rotationSum, Eigen::ComputeFullU | Eigen::ComputeFullV);
+      Eigen::Matrix3d reflection = Eigen::Matrix3d::Identity();
+      reflection(2, 2) = (svd.matrixU()*svd.matrixV().transpose()).determinant();
+      Eigen::Matrix4d pose = Eigen::Matrix4d::Identity();
+      pose.block<3, 3>(0, 0) = svd.matrixU()*reflection*svd.matrixV().transpose();
+      pose.block<3, 1>(0, 3) = translationSum / weightSum;
+
+      change = std::max(change, (pose - Eigen::Matrix4d(this->poses[node])).norm());
+      this->poses[node] = pose;
+    }
+    if (change < 1e-10) break;
+  }
+}
+
+/* Disables, one at a time, the edge which disagrees the most with the
+   others until every edge left is within the tolerances. An edge whose
+   removal would disconnect the graph is kept, it has nothing to disagree
+   with. Returns the number of disabled edges. */
+size_t
+PoseGraph::removeInconsistentEdges(double maxDistance, double maxAngle)
+{
+  size_t nRemoved = 0;
+  while (true)
+  {
+    this->solve();
+    size_t nComponents = CountComponents(this->findComponents());
+    double worstError = 1;
+    size_t worst = this->edges.size();
+    for (size_t i = 0; i < this->edges.size(); ++i)
+    {
+      if (!this->edges[i].enabled) continue;
+      // The scans apart from the first one have no pose to disagree with
+      if (!this->placed[this->edges[i].source] || !this->placed[this->edges[i].target])
+        continue;
+      double distance, angle;
+      this->edgeResidual(i, distance, angle);
+      double error = std::max(distance / maxDistance, angle / maxAngle);
+      if (error <= worstError) continue;
+
+      this->edges[i].enabled = false;
+      size_t nWithout = CountComponents(this->findComponents());
+      this->edges[i].enabled = true;
+      if (nWithout > nComponents) continue;
+
+      worstError = error;
+      worst = i;
+    }
+    if (worst == this->edges.size()) break;
+    this->edges[worst].enabled = false;
+    ++nRemoved;
+  }
+  return nRemoved;
+}
+
+bool
+PoseGraph::isConnected() const
+{
+  std::vector<size_t> components = this->findComponents();
+  for (size_t node = 0; node < this->nNodes; ++node)
+  {
+    if (components[node] != components[0]) return false;
+  }
+  return true;
+}
+
+bool
+PoseGraph::isPlaced(size_t node) const
+{
+  return this->placed[node];
+}
+
+Eigen::Matrix4d
+PoseGraph::getPose(size_t node) const
+{
+  return this->poses[node];
+}
+
+const std::vector<PoseGraphEdge>&
+PoseGraph::getEdges() const
+{
+  return this->edges;
+}
+
+/* Disagreement between an edge and the poses of its scans : the angle (in
+   radians) of the transform which remains after going from the source to the
+   target with the poses and coming back with the edge, and how far it moves
+   the center of the edge. Measured there rather than at the origin of the
+   frame, which may be far from the stems. */
+void
+PoseGraph::edgeResidual(size_t edge, double& distance, double& angle) const
+{
+  const PoseGraphEdge& it = this->edges[edge];
+  Eigen::Matrix4d residual = Eigen::Matrix4d(it.transform).inverse()
+                             *Eigen::Matrix4d(this->poses[it.target]).inverse()
+                             *Eigen::Matrix4d(this->poses[it.source]);
+  Eigen::Vector3d center = it.center;
+  distance = (residual.block<3, 3>(0, 0)*center + residual.block<3, 1>(0, 3) - center).norm();
+  double cosAngle = (residual.block<3, 3>(0, 0).trace() - 1)/2;
+  angle = acos(std::min(1.0, std::max(-1.0, cosAngle)));
+}
+
+// Label of the connected component of each node, the smallest node in it.
+std::vector<size_t>
+PoseGraph::findComponents() const
+{
+  std::vector<size_t> components(this->nNodes);
+  for (size_t node = 0; node < this->nNodes; ++node) components[node] = node;
+
+  auto root = [&components](size_t node) -> size_t
+  {
+    while (components[node] != node) node = components[node];
+    return node;
+  };
+  for (const auto& edge : this->edges)
+  {
+    if (!edge.enabled) continue;
+    size_t a = root(edge.source);
+    size_t b = root(edge.target);
+    components[std::max(a, b)] = std::min(a, b);
+  }
+  for (size_t node = 0; node < this->nNodes; ++node)
+    components[node] = root(node);
+  return components;
+}
+
+/* Places the scans along the maximum weight spanning tree grown from the
+   first scan, so each pose comes from the most reliable chain of edges. */
+void
+PoseGraph::initializePoses()
+{
+  std::fill(this->placed.begin(), this->placed.end(), false);
+  std::fill(this->poses.begin(), this->poses.end(), Eigen::Matrix4d::Identity());
+  if (this->nNodes == 0) return;
+  this->placed[0] = true;
+
+  while (true)
+  {
+    const PoseGraphEdge* best = nullptr;
+    for (const auto& edge : this->edges)
+    {
+      if (edge.enabled
+          && this->placed[edge.source] != this->placed[edge.target]
+          && (best == nullptr || edge.weight > best->weight))
+        best = &edge;
+    }
+    if (best == nullptr) break;
+
+    size_t node = this->placed[best->source] ? best->target : best->source;
+    this->poses[node] = this->predictPose(*best, node);
+    this->placed[node] = true;
+  }
+}
+
+// Pose of node given by an edge and the pose of the scan at its other end.
+Eigen::Matrix4d
+PoseGraph::predictPose(const PoseGraphEdge& edge, size_t node) const
+{
+  if (node == edge.source)
+    return Eigen::Matrix4d(this->poses[edge.target])*Eigen::Matrix4d(edge.transform);
+  return Eigen::Matrix4d(this->poses[edge.source])*Eigen::Matrix4d(edge.transform).inverse();
+}
+
+} // namespace tlr
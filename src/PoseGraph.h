@@ -0,0 +1,81 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef TLR_POSEGRAPH_H_
+#define TLR_POSEGRAPH_H_
+
+#include <Eigen/Dense>
+#include <vector>
+
+namespace tlr
+{
+
+/* A registration between two scans : transform maps the coordinates of the
+   source scan into the frame of the target scan. Edges found inconsistent
+   with the others are disabled instead of removed. */
+struct PoseGraphEdge
+{
+  size_t source;
+  size_t target;
+  // Unaligned so the edges can be stored in a std::vector, see PairOfStemGroups
+  Eigen::Matrix<double, 4, 4, Eigen::DontAlign> transform;
+  double weight;
+  // Centroid of the matched source stems, where the residuals are measured
+  Eigen::Matrix<double, 3, 1, Eigen::DontAlign> center;
+  bool enabled;
+};
+
+/**
+ * \brief Places scans in a single frame from pairwise registrations
+ *
+ * The pose of a scan maps its coordinates into the frame of the first scan.
+ * The poses are initialized along the maximum weight spanning tree of the
+ * registrations, then refined by minimizing the weighted chordal distance
+ * between each pose and the poses predicted by its neighbours, one scan at
+ * a time. When the registrations form loops, the residual of each edge tells
+ * whether it agrees with the others.
+ */
+class PoseGraph
+{
+ public:
+  explicit PoseGraph(size_t nNodes);
+  void addEdge(size_t source, size_t target, const Eigen::Matrix4d& transform,
+               double weight, const Eigen::Vector3d& center);
+  void solve(size_t maxIterations = 100);
+  size_t removeInconsistentEdges(double maxDistance, double maxAngle);
+  bool isConnected() const;
+  std::vector<size_t> findComponents() const;
+  bool isPlaced(size_t node) const;
+  Eigen::Matrix4d getPose(size_t node) const;
+  const std::vector<PoseGraphEdge>& getEdges() const;
+  void edgeResidual(size_t edge, double& distance, double& angle) const;
+
+ private:
+  void initializePoses();
+  Eigen::Matrix4d predictPose(const PoseGraphEdge& edge, size_t node) const;
+
+  size_t nNodes;
+  std::vector<PoseGraphEdge> edges;
+  std::vector<Eigen::Matrix<double, 4, 4, Eigen::DontAlign>> poses;
+  std::vector<bool> placed; // Connected to the first scan
+};
+
+} // namespace tlr
+#endif
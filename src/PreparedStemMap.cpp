@@ -0,0 +1,215 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "PreparedStemMap.h"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+
+namespace tlr
+{
+
+PreparedStemMap::PreparedStemMap(const StemMap& stemMap, double RANSACtol,
+                                 bool withTriplets) :
+  stemMap(stemMap),
+  triplets(nullptr),
+  nTriplets(0),
+  RANSACtol(RANSACtol),
+  withTriplets(withTriplets)
+{
+  auto start = std::chrono::steady_clock::now();
+  const Stem* stems = this->stemMap.getStems().data();
+  this->arrays = StemArrays(this->stemMap);
+  if (withTriplets) GenerateTriplets(this->stemMap, this->ownTriplets);
+  this->triplets = this->ownTriplets.data();
+  this->nTriplets = this->ownTriplets.size();
+  this->radiusIndex = RadiusIndex(this->stemMap);
+  this->grid = StemGrid(this->stemMap, RANSACtol);
+  std::vector<TripletDescriptor> descriptors;
+  descriptors.reserve(this->nTriplets);
+  for (const auto& it : this->ownTriplets) descriptors.push_back(DescribeTriplet(stems, it));
+  this->tripletIndex = TripletIndex(std::move(descriptors), 2*RANSACtol);
+  this->preparationTime = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+/* From triplets and their index read in place in a mapped cache file, which
+   is kept mapped as long as the map lives, see LoadPreparedStemMap. Only the
+   stem grid and the radius index, which are linear in the number of stems,
+   are built. */
+PreparedStemMap::PreparedStemMap(const StemMap& stemMap, double RANSACtol,
+                                 std::shared_ptr<const MappedFile> cacheFile,
+                                 const TripletStems* triplets, TripletIndex tripletIndex) :
+  stemMap(stemMap),
+  cacheFile(cacheFile),
+  triplets(triplets),
+  nTriplets(tripletIndex.size()),
+  tripletIndex(std::move(tripletIndex)),
+  RANSACtol(RANSACtol),
+  withTriplets(true)
+{
+  auto start = std::chrono::steady_clock::now();
+  this->arrays = StemArrays(this->stemMap);
+  this->radiusIndex = RadiusIndex(this->stemMap);
+  this->grid = StemGrid(this->stemMap, RANSACtol);
+  this->preparationTime = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+PreparedStemMap::~PreparedStemMap()
+{
+}
+
+const StemMap&
+PreparedStemMap::getStemMap() const
+{
+  return this->stemMap;
+}
+
+const std::vector<Stem, Eigen::aligned_allocator<Stem>>&
+PreparedStemMap::getStems() const
+{
+  return this->stemMap.getStems();
+}
+
+const StemArrays&
+PreparedStemMap::getArrays() const
+{
+  return this->arrays;
+}
+
+size_t
+PreparedStemMap::getNumberOfTriplets() const
+{
+  return this->nTriplets;
+}
+
+const TripletStems&
+PreparedStemMap::getTripletStems(size_t indice) const
+{
+  return this->triplets[indice];
+}
+
+StemGroup
+PreparedStemMap::getTriplet(size_t indice) const
+{
+  const auto& stems = this->stemMap.getStems();
+  const TripletStems& triplet = this->triplets[indice];
+  return {&stems[triplet[0]], &stems[triplet[1]], &stems[triplet[2]]};
+}
+
+const RadiusIndex&
+PreparedStemMap::getRadiusIndex() const
+{
+  return this->radiusIndex;
+}
+
+const StemGrid&
+PreparedStemMap::getGrid() const
+{
+  return this->grid;
+}
+
+const TripletIndex&
+PreparedStemMap::getTripletIndex() const
+{
+  return this->tripletIndex;
+}
+
+// False if the triplets were left out, see the constructor
+bool
+PreparedStemMap::hasTriplets() const
+{
+  return this->withTriplets;
+}
+
+double
+PreparedStemMap::getRANSACtol() const
+{
+  return this->RANSACtol;
+}
+
+double
+PreparedStemMap::getPreparationTime() const
+{
+  return this->preparationTime;
+}
+
+size_t
+PreparedStemMap::indiceOf(const Stem* stem) const
+{
+  return stem - this->stemMap.getStems().data();
+}
+
+long long
+NChoose2(long long n)
+{
+  return n < 2 ? 0 : n*(n - 1)/2;
+}
+
+long long
+NChoose3(long long n)
+{
+  return n < 3 ? 0 : n*(n - 1)*(n - 2)/6;
+}
+
+/* Position of the triplet of 0-based indices i < j < k among the triplets
+   of n stems listed in lexicographic order, as GenerateTriplets does. */
+size_t
+TripletIndice(size_t i, size_t j, size_t k, size_t n)
+{
+  return NChoose3(n) - NChoose3(n - i)                 // First stem before i
+         + NChoose2(n - i - 1) - NChoose2(n - j)       // Then second before j
+         + (k - j - 1);
+}
+
+/* This function populate the stem triplets of a stem map, every way to
+   choose three stems, in the lexicographic order of their indices. */
+void
+GenerateTriplets(const StemMap& stemMap, std::vector<TripletStems>& threePerm)
+{
+  const auto& stems = stemMap.getStems();
+  size_t n = stems.size();
+  if (n > std::numeric_limits<uint32_t>::max())
+    throw std::length_error("Too many stems to index their triplets");
+  threePerm.reserve(threePerm.size() + NChoose3(n));
+  // As SortStemPointers, by radius then by position in the map
+  auto byRadius = [&stems](uint32_t left, uint32_t right) -> bool
+  {
+    return SortStemPointers(&stems[left], &stems[right]);
+  };
+
+  for (uint32_t i = 0; i < n; ++i)
+  {
+    for (uint32_t j = i + 1; j < n; ++j)
+    {
+      for (uint32_t k = j + 1; k < n; ++k)
+      {
+        TripletStems tempTriplet = {i, j, k};
+        // Sorted like in PairOfStemGroups so the filters can compare them as is
+        std::sort(tempTriplet.begin(), tempTriplet.end(), byRadius);
+        threePerm.push_back(tempTriplet);
+      }
+    }
+  }
+}
+
+} // namespace tlr
@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef TLR_PREPAREDSTEMMAP_H_
+#define TLR_PREPAREDSTEMMAP_H_
+
+#include "TripletIndex.h"
+#include "StemGrid.h"
+#include "RadiusIndex.h"
+#include <cstdint>
+#include <memory>
+
+namespace tlr
+{
+
+class MappedFile;
+
+size_t TripletIndice(size_t i, size_t j, size_t k, size_t n);
+void GenerateTriplets(const StemMap& stemMap, std::vector<TripletStems>& threePerm);
+
+/**
+ * \brief A stem map with everything Registration computes from it alone
+ *
+ * This is the part of the preprocessing that doesn't depend on the other
+ * map : the triplets, the stems sorted by radius, the stem grid and the
+ * triplet index. It is immutable once built, so one PreparedStemMap can be
+ * shared (through a std::shared_ptr) by several registrations, even running
+ * concurrently. The grid and the triplet index depend on RANSACtol, which is
+ * fixed at construction. The triplets can be left out when only the 4-DOF
+ * registration, which doesn't use them, will be run.
+ */
+class PreparedStemMap
+{
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  PreparedStemMap(const StemMap& stemMap, double RANSACtol, bool withTriplets = true);
+  PreparedStemMap(const StemMap& stemMap, double RANSACtol,
+                  std::shared_ptr<const MappedFile> cacheFile,
+                  const TripletStems* triplets, TripletIndex tripletIndex);
+  PreparedStemMap(const PreparedStemMap&) = delete;
+  PreparedStemMap& operator=(const PreparedStemMap&) = delete;
+  ~PreparedStemMap();
+
+  const StemMap& getStemMap() const;
+  const std::vector<Stem, Eigen::aligned_allocator<Stem>>& getStems() const;
+  const StemArrays& getArrays() const;
+  size_t getNumberOfTriplets() const;
+  const TripletStems& getTripletStems(size_t indice) const;
+  // Allocated, for building a PairOfStemGroups
+  StemGroup getTriplet(size_t indice) const;
+  const RadiusIndex& getRadiusIndex() const;
+  const StemGrid& getGrid() const;
+  const TripletIndex& getTripletIndex() const;
+  bool hasTriplets() const;
+  double getRANSACtol() const;
+  // Wall time, in seconds, taken to build it
+  double getPreparationTime() const;
+  // Indice in the map of one of its stems
+  size_t indiceOf(const Stem* stem) const;
+
+ private:
+  StemMap stemMap;
+  StemArrays arrays;
+  // Kept mapped while the triplets and their index are read from it
+  std::shared_ptr<const MappedFile> cacheFile;
+  std::vector<TripletStems> ownTriplets; // Unless they are in cacheFile
+  const TripletStems* triplets; // In the order of GenerateTriplets
+  size_t nTriplets;
+  RadiusIndex radiusIndex;
+  StemGrid grid;
+  TripletIndex tripletIndex;
+  double RANSACtol;
+  double preparationTime;
+  bool withTriplets;
+};
+
+} // namespace tlr
+#endif
@@ -0,0 +1,108 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include "RadiusIndex.h"
+#include <algorithm>
+#include <math.h>
+
+namespace tlr
+{
+
+// Same test as Registration::relDiamErrorGreaterThanTol
+static bool
+Corresponding(double radius1, double radius2, double diamErrorTol)
+{
+  return !(fabs(radius1 - radius2) /
+           ((radius1 + radius2)/2) > diamErrorTol);
+}
+
+RadiusIndex::RadiusIndex()
+{
+}
+
+RadiusIndex::RadiusIndex(const StemMap& stemMap)
+{
+  const auto& stems = stemMap.getStems();
+  for (size_t i = 0; i < stems.size(); ++i) this->indices.push_back(i);
+  std::sort(this->indices.begin(), this->indices.end(),
+            [&stems](size_t left, size_t right) -> bool
+            {
+              if (stems[left].getRadius() != stems[right].getRadius())
+                return stems[left].getRadius() < stems[right].getRadius();
+              return left < right;
+            });
+
+  this->ranks.resize(stems.size());
+  for (size_t rank = 0; rank < this->indices.size(); ++rank)
+  {
+    this->radii.push_back(stems[this->indices[rank]].getRadius());
+    this->ranks[this->indices[rank]] = rank;
+  }
+}
+
+/* Range [begin, end) of the ranks of the stems whose radius corresponds to
+   radius. The relative error decreases as the radii get closer, so the
+   corresponding radii are contiguous. */
+void
+RadiusIndex::window(double radius, double diamErrorTol,
+                    size_t& begin, size_t& end) const
+{
+  auto first = std::partition_point(this->radii.begin(), this->radii.end(),
+                                     [radius, diamErrorTol](double other) -> bool
+                                     {
+                                       return other < radius && !Corresponding(radius, other, diamErrorTol);
+                                     });
+  auto last = std::partition_point(first, this->radii.end(),
+                                   [radius, diamErrorTol](double other) -> bool
+                                   {
+                                     return other <= radius || Corresponding(radius, other, diamErrorTol);
+                                   });
+  begin = first - this->radii.begin();
+  end = last - this->radii.begin();
+}
+
+bool
+RadiusIndex::hasCorresponding(double radius, double diamErrorTol) const
+{
+  size_t begin, end;
+  this->window(radius, diamErrorTol, begin, end);
+  return begin < end;
+}
+
+size_t
+RadiusIndex::getIndice(size_t rank) const
+{
+  return this->indices[rank];
+}
+
+size_t
+RadiusIndex::getRank(size_t indice) const
+{
+  return this->ranks[indice];
+}
+
+size_t
+RadiusIndex::size() const
+{
+  return this->radii.size();
+}
+
+} // namespace tlr
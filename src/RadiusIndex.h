@@ -0,0 +1,58 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef TLR_RADIUSINDEX_H_
+#define TLR_RADIUSINDEX_H_
+
+#include "StemMap.h"
+
+namespace tlr
+{
+
+/**
+ * \brief View of the stems of a map sorted by radius
+ *
+ * The stems whose radius corresponds to a given radius (relative error
+ * under diamErrorTol) are contiguous in this view, so they are found with
+ * two binary searches. The tolerance is given with each query, so one
+ * index serves registrations with different tolerances. The position of a stem in the view is its rank.
+ * Stems of equal radius are ranked by their indice in the map.
+ */
+class RadiusIndex
+{
+ public:
+  RadiusIndex();
+  RadiusIndex(const StemMap& stemMap);
+  void window(double radius, double diamErrorTol,
+              size_t& begin, size_t& end) const;
+  bool hasCorresponding(double radius, double diamErrorTol) const;
+  size_t getIndice(size_t rank) const;
+  size_t getRank(size_t indice) const;
+  size_t size() const;
+
+ private:
+  std::vector<double> radii;   // Sorted
+  std::vector<size_t> indices; // Indice in the map of the stem of each rank
+  std::vector<size_t> ranks;   // Rank of each stem of the map
+};
+
+} // namespace tlr
+#endif
@@ -21,219 +21,1081 @@
 #include "Registration.h"
 #include <atomic>
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+#include <math.h>
+#include <omp.h>
 
 namespace tlr
 {
 
+// Number of pairs evaluated between two checks of the time limit
+static const size_t TimeLimitChunkSize = 1024;
+/* Number of samples (source groups) whose pairs are evaluated between two
+   checks of the adaptive criterion, so also the fewest samples it draws */
+static const size_t AdaptiveSampleChunk = 64;
+// Seed of the order the samples are drawn in, fixed to repeat the results
+static const unsigned int AdaptiveSeed = 1;
+// Cells of the Hough accumulator refined by RANSAC, at least options.topK
+static const size_t HoughPeaks = 10;
+// Cells with the most votes among which the peaks are chosen, per peak
+static const size_t HoughCandidatesPerPeak = 10;
+
+// Votes of a cell of the Hough accumulator, with the first pair voting for it
+struct HoughVotes
+{
+  size_t votes = 0;
+  size_t order;
+  CandidatePair candidate;
+};
+typedef std::unordered_map<TransformCell, HoughVotes, TransformCellHash> HoughAccumulator;
+
+// Adds votes for a cell, keeping the pair which comes first among the candidates.
+static void
+AddVotes(HoughVotes& cell, size_t votes, size_t order, const CandidatePair& candidate)
+{
+  if (cell.votes == 0 || order < cell.order)
+  {
+    cell.order = order;
+    cell.candidate = candidate;
+  }
+  cell.votes += votes;
+}
+
+// Wall time elapsed since start, in seconds
+static double
+SecondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// See RegistrationOptions::timeLimit
+static bool
+OverTimeLimit(std::chrono::steady_clock::time_point start, double timeLimit)
+{
+  return timeLimit > 0 && SecondsSince(start) > timeLimit;
+}
+
+/* GetVerticeDifference of two triplets given by the indices of their stems,
+   without building their stem groups. */
+static void
+TripletVerticeDifference(const Stem* sourceStems, const TripletStems& sourceTriplet,
+                         const Stem* targetStems, const TripletStems& targetTriplet,
+                         double* differences)
+{
+  for (size_t i = 0; i < 3; ++i)
+  {
+    size_t next = i == 2 ? 0 : i + 1;
+    Eigen::Vector4d sourceVector = sourceStems[sourceTriplet[i]].getCoords()
+                                   - sourceStems[sourceTriplet[next]].getCoords();
+    Eigen::Vector4d targetVector = targetStems[targetTriplet[i]].getCoords()
+                                   - targetStems[targetTriplet[next]].getCoords();
+    differences[i] = fabs(sourceVector.norm() - targetVector.norm());
+  }
+}
+
+RegistrationOptions
+MakeOptions(double diamErrorTol, double RANSACtol, bool kelbeRegistration)
+{
+  RegistrationOptions options;
+  options.diamErrorTol = diamErrorTol;
+  options.RANSACtol = RANSACtol;
+  options.kelbeRegistration = kelbeRegistration;
+  return options;
+}
+
+bool
+NeedsTriplets(const RegistrationOptions& options)
+{
+  return !options.fourDof || options.kelbeRegistration;
+}
+
 // Getting ready for RANSAC, no heavy computation yet.
 Registration::Registration(const StemMap& target, const StemMap& source,
                            double diamErrorTol, double RANSACtol,
                            bool kelbeRegistration) :
-  diamErrorTol(diamErrorTol),
-  RANSACtol(RANSACtol),
+  Registration(target, source, MakeOptions(diamErrorTol, RANSACtol, kelbeRegistration))
+{
+}
+
+Registration::Registration(const StemMap& target, const StemMap& source,
+                           const RegistrationOptions& options) :
+  Registration(std::make_shared<const PreparedStemMap>(target, options.RANSACtol,
+                                                      NeedsTriplets(options)),
+               std::make_shared<const PreparedStemMap>(source, options.RANSACtol,
+                                                      NeedsTriplets(options)),
+               options)
+{
+}
+
+Registration::Registration(std::shared_ptr<const PreparedStemMap> target,
+                           std::shared_ptr<const PreparedStemMap> source,
+                           const RegistrationOptions& options) :
+  options(options),
   target(target),
   source(source),
-  kelbeRegistration(kelbeRegistration)
+  startTime(std::chrono::steady_clock::now())
 {
-  std::cout << "Number of unmatched stems: " << this->removeLonelyStems() << std::endl;
-  std::cout << "Number of stems in source: " << this->source.getStems().size() << std::endl;
-  std::cout << "Number of stems in target: " << this->target.getStems().size() << std::endl;
-  this->generateTriplets(this->source, this->threePermSource);
-  this->generateTriplets(this->target, this->threePermTarget);
+  if (this->target->getRANSACtol() != this->options.RANSACtol
+      || this->source->getRANSACtol() != this->options.RANSACtol)
+    throw std::invalid_argument("Stem maps prepared for another RANSAC tolerance");
+  if (NeedsTriplets(this->options)
+      && (!this->target->hasTriplets() || !this->source->hasTriplets()))
+    throw std::invalid_argument("Stem maps prepared without their triplets");
+
+  this->stats.prepareTime = this->target->getPreparationTime()
+                            + this->source->getPreparationTime();
+  // The rotation moving the farthest source stem by RANSACtol
+  const auto& sourceStems = this->source->getStems();
+  this->sourceCenter = Eigen::Vector3d::Zero();
+  for (const auto& it : sourceStems) this->sourceCenter += it.getCoords().head<3>();
+  if (!sourceStems.empty()) this->sourceCenter /= sourceStems.size();
+  double extent = this->options.RANSACtol;
+  for (const auto& it : sourceStems)
+    extent = std::max(extent, (it.getCoords().head<3>() - this->sourceCenter).norm());
+  this->bucketAngle = this->options.RANSACtol / extent;
+
+  this->stats.nSourceTriplets = this->source->getNumberOfTriplets();
+  this->stats.nTargetTriplets = this->target->getNumberOfTriplets();
+  auto start = std::chrono::steady_clock::now();
+  this->stats.nUnmatchedStems = this->findLonelyStems();
+  this->stats.lonelyStemsTime = SecondsSince(start);
+
+  std::ostream& log = *this->options.log;
+  log << "Number of unmatched stems: " << this->stats.nUnmatchedStems << std::endl;
+  log << "Number of stems in source: " << this->nMatchedSource << std::endl;
+  log << "Number of stems in target: " << this->nMatchedTarget << std::endl;
+  if (this->isFourDof())
+    log << "4-DOF registration, hypotheses from pairs of stems. " << std::endl;
+  // Every path stores the groups of its pairs as CandidatePair, see makeCandidate
+  if (this->getNumberOfSourceGroups() > std::numeric_limits<uint32_t>::max()
+      || this->getNumberOfTargetGroups() > std::numeric_limits<uint32_t>::max())
+    throw std::length_error("Too many triplets (or pairs of stems) to index them");
+  if (this->isAdaptive()) this->drawSamples();
+  if (this->isStreaming())
+  {
+    log << "Streaming pairs in batches of "
+        << this->options.streamBatchSize << ". " << std::endl;
+    return; // The pairs are generated along with the RANSAC
+  }
+  if (this->isHough())
+  {
+    log << "Hough voting registration. " << std::endl;
+    return; // The pairs vote as they are generated
+  }
+  start = std::chrono::steady_clock::now();
   this->generatePairs();
-  std::cout << this->pairsOfStemTriplets.size() << " transforms to compute. " << std::endl;
+  this->stats.pairsTime = SecondsSince(start);
+  log << this->candidatePairs.size() << " transforms to compute. " << std::endl;
 }
 
 void
 Registration::computeBestTransform()
 {
-  if (this->pairsOfStemTriplets.size() == 0) return; // Nothing to compute
+  if (this->isStreaming())
+  {
+    this->streamPairs();
+    return;
+  }
+  if (this->isHough())
+  {
+    this->voteTransforms();
+    return;
+  }
+  if (this->candidatePairs.size() == 0) return; // Nothing to compute
 
   // Compute all possible transforms in parallel
   size_t nRansacIter;
-  if (this->kelbeRegistration) {
+  if (this->options.kelbeRegistration) {
     // Try 1000 best candidates in kelbe registration. If we try all it will
     // be too long. Trying the 1000 best candidates will still be very fast
     // and is more than enough.
-    nRansacIter = std::min(this->pairsOfStemTriplets.size(), (size_t)1000);
+    nRansacIter = std::min(this->candidatePairs.size(), (size_t)1000);
   }
   else
   {
-    nRansacIter = this->pairsOfStemTriplets.size();  
+    nRansacIter = this->candidatePairs.size();  
   }
 
-  #pragma omp parallel for
-  for (size_t i = 0; i < nRansacIter; ++i)
+  /* Evaluate the pairs chunk by chunk so we can stop as soon as the adaptive
+     criterion is met or the time is up. The adaptive chunks are the pairs of
+     AdaptiveSampleChunk samples, as in streamPairs. Without either there is
+     a single chunk. The chunks don't depend on the number of threads, so
+     neither does the result, unless the time limit is reached. When
+     clustering, each chunk is clustered on its own, see evaluateClusters. */
+  size_t chunkSize = this->options.timeLimit > 0 ? TimeLimitChunkSize : nRansacIter;
+  size_t nSamples = this->sampleEnds.size(); // 0 unless adaptive
+  size_t nSamplesDone = 0;
+  size_t nEvaluated = 0;
+  size_t bestInliers = 0;
+  size_t sumInliers = 0;
+  size_t nClustered = 0;
+  auto start = std::chrono::steady_clock::now();
+  // Each thread keeps its best pairs, they are merged at the end
+  std::vector<TopPairs> threadBest(omp_get_max_threads(), TopPairs(this->options.topK));
+  TopPairs clusteredBest(this->options.topK);
+  std::vector<size_t> orders; // Of the chunk, when clustering
+  while (nEvaluated < nRansacIter
+         && nSamplesDone < this->requiredSamples(bestInliers))
   {
-    // Compute a first transform then see if other stems matches
-    this->pairsOfStemTriplets[i].computeBestTransform();
-    this->RANSACtransform(this->pairsOfStemTriplets[i]);
+    if (OverTimeLimit(this->startTime, this->options.timeLimit))
+    {
+      this->stats.timedOut = true;
+      break;
+    }
+    size_t end;
+    if (this->isAdaptive())
+    {
+      nSamplesDone = std::min(nSamples, nSamplesDone + AdaptiveSampleChunk);
+      end = this->sampleEnds[nSamplesDone - 1];
+    }
+    else
+      end = std::min(nRansacIter, nEvaluated + chunkSize);
+
+    if (this->options.clusterHypotheses)
+    {
+      orders.resize(end - nEvaluated);
+      std::iota(orders.begin(), orders.end(), nEvaluated);
+      if (this->evaluateClusters(&this->candidatePairs[nEvaluated], orders.data(),
+                                 orders.size(), clusteredBest, nEvaluated, nClustered,
+                                 bestInliers, sumInliers))
+      {
+        this->stats.timedOut = true;
+        break;
+      }
+      continue;
+    }
+
+    #pragma omp parallel for schedule(dynamic) reduction(max:bestInliers) reduction(+:sumInliers)
+    for (size_t i = nEvaluated; i < end; ++i)
+    {
+      PairOfStemGroups pair = this->evaluateCandidate(this->candidatePairs[i]);
+      bestInliers = std::max(bestInliers, pair.getTargetGroup().size());
+      sumInliers += pair.getTargetGroup().size();
+      threadBest[omp_get_thread_num()].add(pair, i);
+    }
+    nEvaluated = end;
   }
+  if (nEvaluated < nRansacIter)
+    this->printStop(nEvaluated, nSamplesDone, nSamples);
+  this->stats.ransacTime = SecondsSince(start);
+  this->stats.nHypotheses = nEvaluated - nClustered;
+  this->stats.nClustered = nClustered;
+  this->stats.meanInliers = this->stats.nHypotheses > 0 ?
+                            double(sumInliers) / this->stats.nHypotheses : 0;
 
-  // Only sort the first 1000 in case of kelbe's registration
-  std::sort(this->pairsOfStemTriplets.begin(), this->pairsOfStemTriplets.begin() + nRansacIter);
+  start = std::chrono::steady_clock::now();
+  TopPairs best = clusteredBest;
+  for (const auto& it : threadBest) best.merge(it);
+  this->bestPairs = best.getPairs();
+  this->refineBestPairs();
+  this->stats.selectionTime = SecondsSince(start);
 }
 
+/* Streaming version of generatePairs followed by computeBestTransform. Each
+   thread enumerates its share of the source triplets, keeps the pairs that
+   pass the filters in a bounded batch and runs RANSAC on the batch as soon as
+   it is full. Only the best pairs of each thread are kept, so the memory used
+   is bounded by the number of threads times the batch size. With the
+   adaptive criterion, the samples go by chunks of AdaptiveSampleChunk as in
+   computeBestTransform, so both stop after the same samples. When clustering,
+   the pairs of a chunk are gathered instead and evaluated together once the
+   chunk is done, see evaluateClusters. Without the adaptive criterion, the
+   chunks are then sized from the pairs of the previous ones to have about
+   the batch size, which bounds the memory. */
 void
-Registration::printFinalReport()
+Registration::streamPairs()
 {
-  // Check if there was any transformation done first
-  if (this->pairsOfStemTriplets.size() == 0)
+  std::atomic<size_t> nEvaluated(0);
+  std::atomic<size_t> bestInliers(0);
+  std::atomic<bool> timedOut(false);
+  std::vector<TopPairs> threadBest(omp_get_max_threads(), TopPairs(this->options.topK));
+  TopPairs clusteredBest(this->options.topK);
+  size_t nIndexCandidates = 0;
+  size_t nFiltered[3] = {0, 0, 0}; // By CandidateFilter
+  size_t sumInliers = 0;
+  size_t nClustered = 0;
+  bool clustering = this->options.clusterHypotheses;
+  size_t nSamples = this->getNumberOfSamples();
+  size_t chunkSize = this->isAdaptive() || clustering ? AdaptiveSampleChunk : nSamples;
+  size_t nSamplesDone = 0;
+  size_t nTargetGroups = this->getNumberOfTargetGroups();
+  // The pairs of the chunk with their orders, when clustering
+  std::vector<std::pair<size_t, CandidatePair>> chunkPairs;
+  std::vector<CandidatePair> chunkCandidates;
+  std::vector<size_t> chunkOrders;
+  size_t peakChunkPairs = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t begin = 0, end = 0; begin < nSamples; begin = end)
   {
-    std::cout << "Failure. No matching pair was found." << std::endl;
-    return;
-  }
+    end = std::min(nSamples, begin + chunkSize);
 
+    #pragma omp parallel reduction(+:nIndexCandidates, sumInliers) reduction(+:nFiltered[:3])
+    {
+      std::vector<CandidatePair> batch;
+      std::vector<size_t> batchOrder; // Rank of each pair among all the candidates
+      TopPairs& best = threadBest[omp_get_thread_num()];
+      batch.reserve(this->options.streamBatchSize);
+      batchOrder.reserve(this->options.streamBatchSize);
 
-  PairOfStemGroups bestPair = *this->pairsOfStemTriplets.begin();
-  std::cout << "====== Best transform ======" << std::endl
-            << bestPair.getBestTransform() << std::endl
-            << "MSE : " << bestPair.getMeanSquareError() << std::endl
-            << "Number of used stems : " << bestPair.getTargetGroup().size() << std::endl
-            << "------ Stems used for registration -----" << std::endl;
-  for (size_t i = 0; i < bestPair.getTargetGroup().size(); ++i)
-  {
-    std::cout << "---- Stem " << i + 1 << " ----" << std::endl
-              << "-- Target --" << std::endl << "Coordinates:" << std::endl
-              << bestPair.getTargetGroup()[i]->getCoords() << std::endl
-              << "Radius: " << bestPair.getTargetGroup()[i]->getRadius() << std::endl
-              << "-- Source --" << std::endl << "Coordinates:" << std::endl
-              << bestPair.getSourceGroup()[i]->getCoords() << std::endl
-              << "Radius: " << bestPair.getSourceGroup()[i]->getRadius() << std::endl;
-  }
-}
+      auto evaluateBatch = [&]()
+      {
+        for (size_t k = 0; k < batch.size(); ++k)
+        {
+          if (timedOut) break;
+          PairOfStemGroups pair = this->evaluateCandidate(batch[k]);
+          best.add(pair, batchOrder[k]);
 
-void
-Registration::RANSACtransform(PairOfStemGroups& pair)
-{
-  StemMap sourceCopy;
+          size_t nInliers = pair.getTargetGroup().size();
+          sumInliers += nInliers;
+          size_t previous = bestInliers;
+          while (nInliers > previous && !bestInliers.compare_exchange_weak(previous, nInliers)) {}
+          ++nEvaluated;
+          if (OverTimeLimit(this->startTime, this->options.timeLimit)) timedOut = true;
+        }
+        batch.clear();
+        batchOrder.clear();
+      };
 
-  sourceCopy = StemMap(this->source);
-  sourceCopy.applyTransMatrix(pair.getBestTransform());
+      std::vector<size_t> candidates;
+      CandidatePair candidate;
 
-  for(size_t i = 0; i < sourceCopy.getStems().size(); ++i)
-  {
-    for(size_t j = 0; j < this->target.getStems().size(); ++j)
+      #pragma omp for schedule(dynamic) nowait
+      for (size_t k = begin; k < end; ++k)
+      {
+        if (timedOut) continue; // Can't break out of an OpenMP loop
+        // Also while generating, since few pairs may pass the filters
+        if (OverTimeLimit(this->startTime, this->options.timeLimit))
+        {
+          timedOut = true;
+          continue;
+        }
+        size_t i = this->getSample(k);
+        candidates.clear();
+        this->findTargetCandidates(i, candidates);
+        nIndexCandidates += candidates.size();
+        for (size_t j : candidates)
+        {
+          CandidateFilter filter = this->makeCandidate(i, j, candidate);
+          ++nFiltered[filter];
+          if (filter == CandidateAccepted)
+          {
+            batch.push_back(candidate);
+            batchOrder.push_back(k*nTargetGroups + j);
+            if (!clustering && batch.size() >= this->options.streamBatchSize)
+              evaluateBatch();
+          }
+        }
+      }
+
+      if (clustering)
+      {
+        #pragma omp critical
+        for (size_t k = 0; k < batch.size(); ++k)
+          chunkPairs.emplace_back(batchOrder[k], batch[k]);
+      }
+      else
+        evaluateBatch(); // Leftovers of the chunk
+    }
+
+    if (clustering && !timedOut)
     {
-      if (!this->stemDistanceGreaterThanTol(sourceCopy.getStems()[i],
-                                            this->target.getStems()[j])
-          &&
-          !this->stemAlreadyInGroup(this->target.getStems()[j],
-                                    pair.getTargetGroup())
-          &&
-          !this->relDiamErrorGreaterThanTol(this->target.getStems()[j],
-                                            this->source.getStems()[i]))
+      // In the order of the candidates, whichever thread made them
+      std::sort(chunkPairs.begin(), chunkPairs.end(),
+                [](const std::pair<size_t, CandidatePair>& left,
+                   const std::pair<size_t, CandidatePair>& right) -> bool
+                { return left.first < right.first; });
+      peakChunkPairs = std::max(peakChunkPairs, chunkPairs.size());
+      chunkOrders.clear();
+      chunkCandidates.clear();
+      for (const auto& it : chunkPairs)
       {
-        // We add the stem who was not transformed
-        pair.addFittingStem(&this->source.getStems()[i],
-                            &this->target.getStems()[j]);
+        chunkOrders.push_back(it.first);
+        chunkCandidates.push_back(it.second);
       }
+      chunkPairs.clear();
+      size_t nChunkEvaluated = 0;
+      size_t best = bestInliers;
+      if (this->evaluateClusters(chunkCandidates.data(), chunkOrders.data(),
+                                 chunkCandidates.size(), clusteredBest, nChunkEvaluated,
+                                 nClustered, best, sumInliers))
+        timedOut = true;
+      nEvaluated += nChunkEvaluated;
+      bestInliers = best;
+    }
+
+    nSamplesDone = end;
+    if (timedOut || end >= this->requiredSamples(bestInliers)) break;
+    /* Without the adaptive criterion, the next chunk has about
+       streamBatchSize pairs, growing at most twice as large at a time */
+    if (clustering && !this->isAdaptive())
+    {
+      size_t nPairs = std::max(nFiltered[CandidateAccepted], (size_t)1);
+      chunkSize = std::min(2*chunkSize, std::max(AdaptiveSampleChunk,
+                                                 this->options.streamBatchSize*end / nPairs));
     }
   }
-  pair.computeBestTransform();
+
+  auto selectionStart = std::chrono::steady_clock::now();
+  TopPairs best = clusteredBest;
+  for (const auto& it : threadBest) best.merge(it);
+  this->bestPairs = best.getPairs();
+  double selectionTime = SecondsSince(selectionStart);
+  this->refineBestPairs();
+
+  // Generating the pairs is part of the RANSAC here
+  this->stats.ransacTime = SecondsSince(start) - selectionTime;
+  this->stats.selectionTime = selectionTime;
+  this->stats.nIndexCandidates = nIndexCandidates;
+  this->stats.nCandidates = nFiltered[CandidateAccepted];
+  this->stats.nDiameterRejected = nFiltered[CandidateDiameterRejected];
+  this->stats.nPositionRejected = nFiltered[CandidatePositionRejected];
+  this->stats.nHypotheses = nEvaluated - nClustered;
+  this->stats.nClustered = nClustered;
+  this->stats.meanInliers = this->stats.nHypotheses > 0 ?
+                            double(sumInliers) / this->stats.nHypotheses : 0;
+  this->stats.timedOut = timedOut;
+  if (timedOut || nSamplesDone < nSamples)
+    this->printStop(nEvaluated, nSamplesDone, nSamples);
+  if (clustering)
+    this->stats.peakCandidateBytes = peakChunkPairs*sizeof(std::pair<size_t, CandidatePair>);
+  else
+    this->stats.peakCandidateBytes = omp_get_max_threads()*this->options.streamBatchSize
+                                     *sizeof(CandidatePair);
+
+  *this->options.log << nEvaluated << " transforms computed. " << std::endl;
 }
 
-/* Return true if a stem is already present in a group.
-   This is useful for the RANSAC part.
-*/
+/* Number of samples (source groups) to draw to have drawn, with a
+   probability of options.confidence, one made only of stems of the best
+   consensus found so far : a triplet, or a pair of stems in the 4-DOF
+   registration. Every pair of such a sample is evaluated, so the one with
+   its corresponding target group too. This is the usual adaptive RANSAC
+   bound, which holds since the samples are drawn at random (drawSamples),
+   with the inlier ratio estimated by the size of that consensus among the
+   source stems. */
+size_t
+Registration::requiredSamples(size_t nInliers) const
+{
+  if (!this->isAdaptive() || nInliers == 0)
+    return std::numeric_limits<size_t>::max();
+
+  double inlierRatio = double(nInliers) / this->source->getStems().size();
+  double pGoodSample = pow(std::min(inlierRatio, 1.0), this->isFourDof() ? 2 : 3);
+  if (pGoodSample >= 1) return AdaptiveSampleChunk;
+  if (this->options.confidence >= 1) return std::numeric_limits<size_t>::max();
+
+  size_t nRequired = (size_t)ceil(log(1 - this->options.confidence) / log(1 - pGoodSample));
+  return std::max(nRequired, AdaptiveSampleChunk);
+}
+
+// Where the evaluation stopped, if it did before the last pair
+void
+Registration::printStop(size_t nEvaluated, size_t nSamplesDone, size_t nSamples) const
+{
+  std::ostream& log = *this->options.log;
+  if (this->stats.timedOut) log << "Time limit reached. ";
+  log << "Stopped after " << nEvaluated << " transforms";
+  if (this->isAdaptive()) log << ", from " << nSamplesDone << " of " << nSamples << " samples";
+  log << ". " << std::endl;
+}
+
+// See RegistrationOptions::confidence
 bool
-Registration::stemAlreadyInGroup(const Stem& stem,
-                                 const StemGroup group) const
+Registration::isAdaptive() const
+{
+  return this->options.confidence > 0 && !this->options.kelbeRegistration
+         && !this->isHough();
+}
+
+/* The source groups in a random order, which the adaptive bound
+   (requiredSamples) assumes, instead of the order of their stems. The seed
+   is fixed, so the registration can be repeated. A pair of stems of the
+   4-DOF registration is only drawn once, with its smaller stem first as in
+   findStemPairCandidates. */
+void
+Registration::drawSamples()
 {
-  for (const auto it : group)
+  size_t nGroups = this->getNumberOfSourceGroups();
+  if (this->isFourDof())
   {
-    if (stem.getCoords() == it->getCoords()) return true;
+    const RadiusIndex& radii = this->source->getRadiusIndex();
+    size_t nStems = this->source->getStems().size();
+    for (size_t i = 0; i < nGroups; ++i)
+    {
+      if (radii.getRank(i / nStems) < radii.getRank(i % nStems))
+        this->samples.push_back(i);
+    }
   }
-  return false;
+  else
+  {
+    this->samples.resize(nGroups);
+    std::iota(this->samples.begin(), this->samples.end(), 0);
+  }
+  std::mt19937 generator(AdaptiveSeed);
+  std::shuffle(this->samples.begin(), this->samples.end(), generator);
 }
 
-bool
-Registration::stemDistanceGreaterThanTol(const Stem& stem1, const Stem& stem2) const
+// Number of source groups enumerated, each one being a sample
+size_t
+Registration::getNumberOfSamples() const
 {
-  Eigen::Vector4d stemError = stem1.getCoords()
-                              - stem2.getCoords();
-  return stemError.norm() > this->RANSACtol;
+  return this->samples.empty() ? this->getNumberOfSourceGroups() : this->samples.size();
+}
+
+// The source group drawn at this rank, see drawSamples
+size_t
+Registration::getSample(size_t rank) const
+{
+  return this->samples.empty() ? rank : this->samples[rank];
 }
 
-// Return true if the relative error between two stems is greater than diamErrorTol
 bool
-Registration::relDiamErrorGreaterThanTol(const Stem& stem1, const Stem& stem2) const
+Registration::isStreaming() const
 {
-  return fabs(stem1.getRadius() - stem2.getRadius()) /
-         ((stem1.getRadius() + stem2.getRadius())/2) > this->diamErrorTol;
+  return this->options.streaming && !this->options.kelbeRegistration && !this->isHough();
 }
 
-Registration::~Registration()
+bool
+Registration::isHough() const
 {
+  return this->options.houghVoting && !this->options.kelbeRegistration;
 }
 
-// Needs refactoring. It does work though
-unsigned int
-Registration::removeLonelyStems()
+/* Hough voting version of generatePairs followed by computeBestTransform.
+   Each pair that passes the filters votes for the cell of its first
+   transform (see bucketOf) in a sparse accumulator, one per thread, with
+   nothing else stored. A true transform gets the votes of every pair of
+   matching stems, split between a few neighbouring cells, so the cells are
+   ranked by the votes of their neighbourhood. RANSAC then only runs on the
+   first pair of the HoughPeaks best cells, skipping the cells next to a
+   better one. */
+void
+Registration::voteTransforms()
 {
-  bool toBeRemoved;
-  std::vector<size_t> indicesToRemove = {};
-  unsigned int nRemoved = 0;
-  size_t i = 0;
-  for (auto& itSource : this->source.getStems())
+  size_t nTargetGroups = this->getNumberOfTargetGroups();
+  std::vector<HoughAccumulator> threadVotes(omp_get_max_threads());
+  size_t nIndexCandidates = 0;
+  size_t nFiltered[3] = {0, 0, 0}; // By CandidateFilter
+  std::atomic<bool> timedOut(false);
+  auto start = std::chrono::steady_clock::now();
+
+  #pragma omp parallel reduction(+:nIndexCandidates) reduction(+:nFiltered[:3])
   {
-    toBeRemoved = true;
-    for (auto& itTarget : this->target.getStems())
+    HoughAccumulator& votes = threadVotes[omp_get_thread_num()];
+    std::vector<size_t> candidates;
+    CandidatePair candidate;
+
+    #pragma omp for schedule(dynamic)
+    for (size_t i = 0; i < this->getNumberOfSourceGroups(); ++i)
     {
-      if (!this->relDiamErrorGreaterThanTol(
-              itTarget, itSource
-         ))
+      if (timedOut) continue; // Can't break out of an OpenMP loop
+      if (OverTimeLimit(this->startTime, this->options.timeLimit))
       {
-        toBeRemoved = false;
+        timedOut = true;
+        continue;
+      }
+      candidates.clear();
+      this->findTargetCandidates(i, candidates);
+      nIndexCandidates += candidates.size();
+      for (size_t j : candidates)
+      {
+        CandidateFilter filter = this->makeCandidate(i, j, candidate);
+        ++nFiltered[filter];
+        if (filter == CandidateAccepted)
+          AddVotes(votes[this->bucketOf(candidate)], 1, i*nTargetGroups + j, candidate);
       }
     }
-    if (toBeRemoved)
-    {
-      indicesToRemove.push_back(i);
-      ++nRemoved;
-    }
-    ++i;
   }
-  // If any stem has to be removed
-  if (indicesToRemove.size() > 0)
+  HoughAccumulator& votes = threadVotes[0];
+  for (size_t t = 1; t < threadVotes.size(); ++t)
   {
-    // Remove the stems backward so the indices are not all shuffled up
-    for (size_t j = indicesToRemove.size() - 1; j > 0; --j)
+    for (const auto& it : threadVotes[t])
+      AddVotes(votes[it.first], it.second.votes, it.second.order, it.second.candidate);
+    threadVotes[t].clear();
+  }
+  // The peaks of the votes so far are still evaluated, there are few of them
+  this->stats.timedOut = timedOut;
+  this->stats.pairsTime = SecondsSince(start);
+  size_t nVoteCells = votes.size();
+
+  // The cells with the most votes, then the votes of their neighbourhood
+  start = std::chrono::steady_clock::now();
+  size_t nPeaks = std::max(HoughPeaks, this->options.topK);
+  std::vector<std::pair<size_t, HoughAccumulator::const_iterator>> ranked;
+  for (auto it = votes.cbegin(); it != votes.cend(); ++it)
+    ranked.push_back({it->second.votes, it});
+  auto moreVotes = [](const std::pair<size_t, HoughAccumulator::const_iterator>& left,
+                      const std::pair<size_t, HoughAccumulator::const_iterator>& right) -> bool
+  {
+    if (left.first != right.first) return left.first > right.first;
+    return left.second->second.order < right.second->second.order;
+  };
+  size_t nRanked = std::min(ranked.size(), nPeaks*HoughCandidatesPerPeak);
+  std::partial_sort(ranked.begin(), ranked.begin() + nRanked, ranked.end(), moreVotes);
+  ranked.resize(nRanked);
+  for (auto& it : ranked)
+  {
+    it.first = 0;
+    TransformCell neighbour;
+    for (size_t offset = 0; offset < 729; ++offset) // 3^6 neighbours
     {
-      this->source.removeStem(indicesToRemove[j]);
+      size_t code = offset;
+      for (size_t k = 0; k < 6; ++k, code /= 3)
+        neighbour.values[k] = it.second->first.values[k] + (long long)(code % 3) - 1;
+      auto found = votes.find(neighbour);
+      if (found != votes.end()) it.first += found->second.votes;
     }
-   }
-  // Repeat for the target map
-  indicesToRemove = {};
-  i = 0;
-  for (auto& itTarget : this->target.getStems())
+  }
+  std::sort(ranked.begin(), ranked.end(), moreVotes);
+
+  // Non-maximum suppression : a cell next to a better one is the same peak
+  std::vector<std::pair<size_t, HoughAccumulator::const_iterator>> peaks;
+  for (const auto& it : ranked)
   {
-    toBeRemoved = true;
-    for (auto& itSource : this->source.getStems())
+    if (peaks.size() == nPeaks) break;
+    bool nextToPeak = false;
+    for (const auto& peak : peaks)
     {
-      if (!this->relDiamErrorGreaterThanTol(
-              itSource, itTarget
-         ))
+      bool adjacent = true;
+      for (size_t k = 0; k < 6; ++k)
       {
-        toBeRemoved = false;
+        adjacent = adjacent && std::abs(peak.second->first.values[k]
+                                        - it.second->first.values[k]) <= 1;
       }
+      nextToPeak = nextToPeak || adjacent;
+    }
+    if (!nextToPeak) peaks.push_back(it);
+  }
+  this->stats.selectionTime = SecondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  size_t sumInliers = 0;
+  std::vector<TopPairs> threadBest(omp_get_max_threads(), TopPairs(this->options.topK));
+  #pragma omp parallel for schedule(dynamic) reduction(+:sumInliers)
+  for (size_t i = 0; i < peaks.size(); ++i)
+  {
+    const HoughVotes& cell = peaks[i].second->second;
+    PairOfStemGroups pair = this->evaluateCandidate(cell.candidate);
+    pair.setSupport(peaks[i].first);
+    sumInliers += pair.getTargetGroup().size();
+    threadBest[omp_get_thread_num()].add(pair, cell.order);
+  }
+  TopPairs best(this->options.topK);
+  for (const auto& it : threadBest) best.merge(it);
+  this->bestPairs = best.getPairs();
+  this->refineBestPairs();
+  this->stats.ransacTime = SecondsSince(start);
+
+  this->stats.nIndexCandidates = nIndexCandidates;
+  this->stats.nCandidates = nFiltered[CandidateAccepted];
+  this->stats.nDiameterRejected = nFiltered[CandidateDiameterRejected];
+  this->stats.nPositionRejected = nFiltered[CandidatePositionRejected];
+  this->stats.nHypotheses = peaks.size();
+  this->stats.meanInliers = peaks.empty() ? 0 : double(sumInliers) / peaks.size();
+  this->stats.peakCandidateBytes = nVoteCells*(sizeof(TransformCell) + sizeof(HoughVotes));
+
+  *this->options.log << nFiltered[CandidateAccepted] << " votes in "
+                     << nVoteCells << " cells. " << std::endl;
+  if (timedOut) *this->options.log << "Time limit reached while voting. " << std::endl;
+}
+
+bool
+Registration::isFourDof() const
+{
+  return !NeedsTriplets(this->options);
+}
+
+/* Number of groups of stems hypotheses are made from : the triplets, or
+   every ordered pair of stems in the 4-DOF registration. */
+size_t
+Registration::getNumberOfSourceGroups() const
+{
+  size_t nStems = this->source->getStems().size();
+  return this->isFourDof() ? nStems*nStems : this->source->getNumberOfTriplets();
+}
+
+size_t
+Registration::getNumberOfTargetGroups() const
+{
+  size_t nStems = this->target->getStems().size();
+  return this->isFourDof() ? nStems*nStems : this->target->getNumberOfTriplets();
+}
+
+StemGroup
+Registration::getSourceGroup(size_t indice) const
+{
+  if (!this->isFourDof()) return this->source->getTriplet(indice);
+  const auto& stems = this->source->getStems();
+  return {&stems[indice / stems.size()], &stems[indice % stems.size()]};
+}
+
+StemGroup
+Registration::getTargetGroup(size_t indice) const
+{
+  if (!this->isFourDof()) return this->target->getTriplet(indice);
+  const auto& stems = this->target->getStems();
+  return {&stems[indice / stems.size()], &stems[indice % stems.size()]};
+}
+
+/* Cell of the first transform of a candidate, in a grid which is bucketAngle
+   wide over the rotation vector and RANSACtol wide over the position of the
+   center of the source map once moved. The transforms of a cell move the
+   source stems by about RANSACtol at most relative to each other, so they
+   are the same hypothesis for RANSAC. */
+TransformCell
+Registration::bucketOf(const CandidatePair& candidate) const
+{
+  PairOfStemGroups pair(this->getTargetGroup(candidate.targetGroup),
+                        this->getSourceGroup(candidate.sourceGroup));
+  this->computeTransform(pair);
+  Eigen::Matrix4d transform = pair.getBestTransform();
+  Eigen::Matrix3d R = transform.block<3, 3>(0, 0);
+  Eigen::AngleAxisd rotation(R);
+  Eigen::Vector3d rotationVector = rotation.angle()*rotation.axis();
+  Eigen::Vector3d center = R*this->sourceCenter + transform.block<3, 1>(0, 3);
+
+  TransformCell cell;
+  for (size_t k = 0; k < 3; ++k)
+  {
+    cell.values[k] = (long long)floor(rotationVector(k) / this->bucketAngle);
+    cell.values[3 + k] = (long long)floor(center(k) / this->options.RANSACtol);
+  }
+  return cell;
+}
+
+/* Evaluates n candidates, sorted by their orders among all the candidates,
+   by buckets (see bucketOf) : RANSAC runs on the first candidate of each
+   bucket, then on the others of the buckets of the topK best, since the
+   first one isn't always the one with the most inliers. The buckets are
+   filled in the order of the candidates, so they don't depend on the
+   threads, and only hold these candidates. nEvaluated counts the candidates
+   gone through, nClustered those among them RANSAC didn't run on. Returns
+   true if the time limit was reached before the end. */
+bool
+Registration::evaluateClusters(const CandidatePair* candidates, const size_t* orders,
+                               size_t n, TopPairs& best, size_t& nEvaluated,
+                               size_t& nClustered, size_t& bestInliers, size_t& sumInliers)
+{
+  std::vector<TransformCell> cells(n);
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (size_t k = 0; k < n; ++k)
+    cells[k] = this->bucketOf(candidates[k]);
+
+  // Positions of the candidates of each bucket, the first one first
+  std::vector<std::vector<size_t>> buckets;
+  std::unordered_map<TransformCell, size_t, TransformCellHash> bucketOfCell;
+  for (size_t k = 0; k < n; ++k)
+  {
+    size_t bucket = bucketOfCell.emplace(cells[k], buckets.size()).first->second;
+    if (bucket == buckets.size()) buckets.emplace_back();
+    buckets[bucket].push_back(k);
+  }
+
+  /* The pairs of the first candidates are ranked by bucket, which is the
+     order of these candidates too. Those of the others by their order. */
+  std::vector<TopPairs> firstBest(omp_get_max_threads(), TopPairs(this->options.topK));
+  std::vector<TopPairs> othersBest(omp_get_max_threads(), TopPairs(this->options.topK));
+  std::vector<std::pair<size_t, size_t>> others; // Bucket and position
+  std::atomic<bool> timedOut(false);
+  size_t nRansac = 0;
+  for (size_t pass = 0; pass < 2 && !timedOut; ++pass)
+  {
+    size_t nPass = pass == 0 ? buckets.size() : others.size();
+    #pragma omp parallel for schedule(dynamic) reduction(max:bestInliers) reduction(+:sumInliers, nRansac)
+    for (size_t i = 0; i < nPass; ++i)
+    {
+      if (timedOut) continue; // Can't break out of an OpenMP loop
+      size_t bucket = pass == 0 ? i : others[i].first;
+      size_t k = pass == 0 ? buckets[bucket].front() : others[i].second;
+      PairOfStemGroups pair = this->evaluateCandidate(candidates[k]);
+      pair.setSupport(buckets[bucket].size());
+      if (pass == 0)
+        firstBest[omp_get_thread_num()].add(pair, bucket);
+      else
+        othersBest[omp_get_thread_num()].add(pair, orders[k]);
+      bestInliers = std::max(bestInliers, pair.getTargetGroup().size());
+      sumInliers += pair.getTargetGroup().size();
+      ++nRansac;
+      if (OverTimeLimit(this->startTime, this->options.timeLimit)) timedOut = true;
     }
-    if (toBeRemoved)
+
+    if (pass == 0)
     {
-      indicesToRemove.push_back(i);
-      ++nRemoved;
+      TopPairs merged(this->options.topK);
+      for (const auto& it : firstBest) merged.merge(it);
+      std::vector<PairOfStemGroups> pairs = merged.getPairs();
+      std::vector<size_t> bucketsOfPairs = merged.getOrders();
+      for (size_t i = 0; i < pairs.size(); ++i)
+      {
+        const std::vector<size_t>& members = buckets[bucketsOfPairs[i]];
+        best.add(pairs[i], orders[members.front()]);
+        for (size_t j = 1; j < members.size(); ++j)
+          others.emplace_back(bucketsOfPairs[i], members[j]);
+      }
     }
-    ++i;
   }
-  if (indicesToRemove.size() > 0)
+  for (const auto& it : othersBest) best.merge(it);
+
+  nEvaluated += timedOut ? nRansac : n;
+  if (!timedOut) nClustered += n - nRansac;
+  return timedOut;
+}
+
+/* Reweighted refinement of the transforms kept, with the RANSAC tolerance as
+   the scale of the residuals. Their order doesn't change. */
+void
+Registration::refineBestPairs()
+{
+  if (this->options.refineIterations == 0) return;
+  for (auto& it : this->bestPairs)
+  {
+    it.computeReweightedTransform(this->options.RANSACtol,
+                                  this->options.refineIterations, this->isFourDof());
+  }
+}
+
+// Least square transform of the pair, restricted to 4-DOF if asked
+void
+Registration::computeTransform(PairOfStemGroups& pair) const
+{
+  if (this->isFourDof())
+    pair.computeBestYawTransform();
+  else
+    pair.computeBestTransform();
+}
+
+void
+Registration::printFinalReport()
+{
+  PrintBestPairs(*this->options.log, this->bestPairs);
+}
+
+// The best transform with its stems, then the alternative ones if any.
+void
+PrintBestPairs(std::ostream& log, const std::vector<PairOfStemGroups>& bestPairs)
+{
+  // Check if there was any transformation done first
+  if (bestPairs.empty())
   {
-    // Remove the stems backward so the indices are not all shuffled up
-    for (size_t j = indicesToRemove.size() - 1; j > 0; --j)
+    log << "Failure. No matching pair was found." << std::endl;
+    return;
+  }
+
+
+  const PairOfStemGroups& bestPair = bestPairs.front();
+  log << "====== Best transform ======" << std::endl
+      << bestPair.getBestTransform() << std::endl
+      << "MSE : " << bestPair.getMeanSquareError() << std::endl
+      << "Number of used stems : " << bestPair.getTargetGroup().size() << std::endl;
+  if (bestPair.getSupport() > 0)
+    log << "Supporting hypotheses : " << bestPair.getSupport() << std::endl;
+  log << "------ Stems used for registration -----" << std::endl;
+  for (size_t i = 0; i < bestPair.getTargetGroup().size(); ++i)
+  {
+    log << "---- Stem " << i + 1 << " ----" << std::endl
+        << "-- Target --" << std::endl << "Coordinates:" << std::endl
+        << bestPair.getTargetGroup()[i]->getCoords() << std::endl
+        << "Radius: " << bestPair.getTargetGroup()[i]->getRadius() << std::endl
+        << "-- Source --" << std::endl << "Coordinates:" << std::endl
+        << bestPair.getSourceGroup()[i]->getCoords() << std::endl
+        << "Radius: " << bestPair.getSourceGroup()[i]->getRadius() << std::endl;
+  }
+
+  // The other transforms kept, if any
+  for (size_t k = 1; k < bestPairs.size(); ++k)
+  {
+    log << "====== Alternative transform " << k << " ======" << std::endl
+        << bestPairs[k].getBestTransform() << std::endl
+        << "MSE : " << bestPairs[k].getMeanSquareError() << std::endl
+        << "Number of used stems : " << bestPairs[k].getTargetGroup().size() << std::endl;
+  }
+}
+
+const std::vector<PairOfStemGroups>&
+Registration::getBestPairs() const
+{
+  return this->bestPairs;
+}
+
+const RegistrationStats&
+Registration::getStats() const
+{
+  return this->stats;
+}
+
+// The best transform and its stems, without the report
+RegistrationResult
+Registration::getResult() const
+{
+  RegistrationResult result;
+  result.stats = this->stats;
+  if (this->bestPairs.empty()) return result;
+
+  const PairOfStemGroups& bestPair = this->bestPairs.front();
+  result.success = true;
+  result.transform = bestPair.getBestTransform();
+  result.meanSquareError = bestPair.getMeanSquareError();
+  result.support = bestPair.getSupport();
+  for (size_t i = 0; i < bestPair.getSourceGroup().size(); ++i)
+  {
+    result.matches.push_back({this->source->indiceOf(bestPair.getSourceGroup()[i]),
+                              this->target->indiceOf(bestPair.getTargetGroup()[i])});
+  }
+  for (size_t k = 1; k < this->bestPairs.size(); ++k)
+    result.alternatives.push_back(this->bestPairs[k].getBestTransform());
+  return result;
+}
+
+// Writes the statistics as a JSON object.
+void
+Registration::printStats(std::ostream& out) const
+{
+  const RegistrationStats& it = this->stats;
+  out << "{" << std::endl
+      << "  \"prepare_s\": " << it.prepareTime << "," << std::endl
+      << "  \"lonely_stems_s\": " << it.lonelyStemsTime << "," << std::endl
+      << "  \"pairs_s\": " << it.pairsTime << "," << std::endl
+      << "  \"ransac_s\": " << it.ransacTime << "," << std::endl
+      << "  \"selection_s\": " << it.selectionTime << "," << std::endl
+      << "  \"unmatched_stems\": " << it.nUnmatchedStems << "," << std::endl
+      << "  \"source_triplets\": " << it.nSourceTriplets << "," << std::endl
+      << "  \"target_triplets\": " << it.nTargetTriplets << "," << std::endl
+      << "  \"index_candidates\": " << it.nIndexCandidates << "," << std::endl
+      << "  \"diameter_rejected\": " << it.nDiameterRejected << "," << std::endl
+      << "  \"position_rejected\": " << it.nPositionRejected << "," << std::endl
+      << "  \"candidates\": " << it.nCandidates << "," << std::endl
+      << "  \"hypotheses\": " << it.nHypotheses << "," << std::endl
+      << "  \"clustered_hypotheses\": " << it.nClustered << "," << std::endl
+      << "  \"mean_inliers\": " << it.meanInliers << "," << std::endl
+      << "  \"peak_candidate_bytes\": " << it.peakCandidateBytes << "," << std::endl
+      << "  \"streaming\": " << (this->isStreaming() ? "true" : "false") << "," << std::endl
+      << "  \"four_dof\": " << (this->isFourDof() ? "true" : "false") << "," << std::endl
+      << "  \"timed_out\": " << (it.timedOut ? "true" : "false") << std::endl
+      << "}" << std::endl;
+}
+
+/* Buffers of RANSACtransform, kept by each thread from one hypothesis to the
+   next so that evaluating one allocates nothing once they are large enough. */
+struct RansacScratch
+{
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> z;
+  std::vector<char> targetInGroup; // All false between two calls
+  std::vector<size_t> neighbours;
+};
+static thread_local RansacScratch Scratch;
+
+void
+Registration::RANSACtransform(PairOfStemGroups& pair)
+{
+  const auto& sourceStems = this->source->getStems();
+  const auto& targetStems = this->target->getStems();
+  size_t nSource = sourceStems.size();
+  RansacScratch& scratch = Scratch;
+  if (scratch.x.size() < nSource)
+  {
+    scratch.x.resize(nSource);
+    scratch.y.resize(nSource);
+    scratch.z.resize(nSource);
+  }
+  if (scratch.targetInGroup.size() < targetStems.size())
+    scratch.targetInGroup.resize(targetStems.size(), false);
+  double* x = scratch.x.data();
+  double* y = scratch.y.data();
+  double* z = scratch.z.data();
+  std::vector<char>& targetInGroup = scratch.targetInGroup;
+  std::vector<size_t>& neighbours = scratch.neighbours;
+
+  TransformStems(this->source->getArrays(), pair.getBestTransform(), x, y, z);
+
+  for (const Stem* it : pair.getTargetGroup())
+    targetInGroup[this->target->indiceOf(it)] = true;
+
+  for(size_t i = 0; i < nSource; ++i)
+  {
+    // Only the target stems within RANSACtol of the transformed stem
+    neighbours.clear();
+    this->target->getGrid().findNeighbours(Eigen::Vector4d(x[i], y[i], z[i], 1), neighbours);
+    for (size_t j : neighbours)
     {
-      this->target.removeStem(indicesToRemove[j]);
+      if (!targetInGroup[j]
+          &&
+          !this->relDiamErrorGreaterThanTol(targetStems[j], sourceStems[i]))
+      {
+        // We add the stem who was not transformed
+        pair.addFittingStem(&sourceStems[i], &targetStems[j]);
+        targetInGroup[j] = true;
+      }
     }
   }
-  return nRemoved;
+  // Only the stems of the group were set
+  for (const Stem* it : pair.getTargetGroup())
+    targetInGroup[this->target->indiceOf(it)] = false;
+  this->computeTransform(pair);
+}
+
+// Return true if the relative error between two stems is greater than diamErrorTol
+bool
+Registration::relDiamErrorGreaterThanTol(const Stem& stem1, const Stem& stem2) const
+{
+  return fabs(stem1.getRadius() - stem2.getRadius()) /
+         ((stem1.getRadius() + stem2.getRadius())/2) > this->options.diamErrorTol;
+}
+
+Registration::~Registration()
+{
+}
+
+/* Finds, for each source stem, the target stems with a corresponding
+   diameter. The stems of each map whose diameter corresponds to no stem of
+   the other map can't be part of a matching pair. They are not removed since
+   the maps may be shared, the source triplets containing one are skipped
+   instead. Returns the number of such stems. */
+unsigned int
+Registration::findLonelyStems()
+{
+  const RadiusIndex& targetRadii = this->target->getRadiusIndex();
+  const RadiusIndex& sourceRadii = this->source->getRadiusIndex();
+  this->nMatchedSource = 0;
+  this->nMatchedTarget = 0;
+
+  this->sourceRadiusWindows.clear();
+  for (const auto& it : this->source->getStems())
+  {
+    RadiusWindow window;
+    targetRadii.window(it.getRadius(), this->options.diamErrorTol,
+                       window.begin, window.end);
+    this->sourceRadiusWindows.push_back(window);
+    if (window.begin < window.end) ++this->nMatchedSource;
+  }
+  // Repeat for the target map
+  for (const auto& it : this->target->getStems())
+  {
+    if (sourceRadii.hasCorresponding(it.getRadius(), this->options.diamErrorTol))
+      ++this->nMatchedTarget;
+  }
+  return this->source->getStems().size() - this->nMatchedSource
+         + this->target->getStems().size() - this->nMatchedTarget;
+}
+
+// True if a stem of the source triplet has no corresponding target stem.
+bool
+Registration::hasLonelyStem(const TripletStems& sourceTriplet) const
+{
+  for (uint32_t it : sourceTriplet)
+  {
+    const RadiusWindow& window = this->sourceRadiusWindows[it];
+    if (window.begin == window.end) return true;
+  }
+  return false;
 }
 
 long long
@@ -246,100 +1108,254 @@ Factorial(int n)
   return result;
 }
 
-// Generates all 3 from K combinations
-std::vector<std::set<int>>
-ThreeCombK(const unsigned int k)
+// This is useful for computing the covariance matrix.
+double
+GetMeanOfVector(const Eigen::Vector4d& coords)
+{
+  return (coords[0] + coords[1] + coords[2]) / 3;
+}
+
+/* Population the candidatePairs attributes with all possible pairs.
+   Each thread keeps the pairs it finds in its own buffer, remembering where
+   the pairs of each source triplet are. The buffers are then merged in the
+   order of the source triplets (of the samples, see drawSamples), so the
+   order of the pairs is the same whatever the number of threads, with no
+   lock while generating them. */
+void
+Registration::generatePairs()
 {
-  std::vector<std::set<int>> result;
-  std::set<int> comb;
+  size_t nSource = this->getNumberOfSamples();
+  std::vector<std::vector<CandidatePair>> threadPairs(omp_get_max_threads());
+  std::vector<int> pairsThread(nSource); // Thread which found the pairs
+  std::vector<size_t> pairsBegin(nSource);
+  std::vector<size_t> pairsEnd(nSource);
+  std::vector<size_t> candidates;
+  CandidatePair candidate;
+  size_t nIndexCandidates = 0;
+  size_t nFiltered[3] = {0, 0, 0}; // By CandidateFilter
+  std::atomic<bool> timedOut(false);
 
-  for (unsigned int i = 1; i < k - 1; ++i)
+  #pragma omp parallel private(candidates, candidate) reduction(+:nIndexCandidates) reduction(+:nFiltered[:3])
   {
-    for (unsigned int j = i; j < k; ++j)
+    std::vector<CandidatePair>& localPairs = threadPairs[omp_get_thread_num()];
+
+    #pragma omp for schedule(dynamic)
+    for (size_t k = 0; k < nSource; ++k)
     {
-      for (unsigned int s = j; s <= k; ++s)
+      // A skipped source triplet keeps an empty range of pairs
+      if (timedOut) continue; // Can't break out of an OpenMP loop
+      if (OverTimeLimit(this->startTime, this->options.timeLimit))
+      {
+        timedOut = true;
+        continue;
+      }
+      size_t i = this->getSample(k);
+      pairsThread[k] = omp_get_thread_num();
+      pairsBegin[k] = localPairs.size();
+      candidates.clear();
+      this->findTargetCandidates(i, candidates);
+      nIndexCandidates += candidates.size();
+      for (size_t j : candidates)
       {
-        comb.insert(i);
-        comb.insert(j);
-        comb.insert(s);
-        // Only add combinaison if the numbers are unique
-        if (comb.size() == 3)
-          result.push_back(comb);
-        comb = std::set<int>();
+        CandidateFilter filter = this->makeCandidate(i, j, candidate);
+        ++nFiltered[filter];
+        if (filter == CandidateAccepted) localPairs.push_back(candidate);
       }
+      pairsEnd[k] = localPairs.size();
     }
   }
 
-  return result;
+  size_t nPairs = 0;
+  for (size_t i = 0; i < nSource; ++i) nPairs += pairsEnd[i] - pairsBegin[i];
+  this->candidatePairs.reserve(nPairs);
+  for (size_t i = 0; i < nSource; ++i)
+  {
+    const std::vector<CandidatePair>& localPairs = threadPairs[pairsThread[i]];
+    this->candidatePairs.insert(this->candidatePairs.end(),
+                                localPairs.begin() + pairsBegin[i],
+                                localPairs.begin() + pairsEnd[i]);
+    if (this->isAdaptive()) this->sampleEnds.push_back(this->candidatePairs.size());
+  }
+  // The thread buffers and the merged pairs are all allocated at this point
+  size_t candidateBytes = this->candidatePairs.capacity()*sizeof(CandidatePair);
+  for (const auto& it : threadPairs) candidateBytes += it.capacity()*sizeof(CandidatePair);
+  threadPairs.clear();
+
+  this->stats.nIndexCandidates = nIndexCandidates;
+  this->stats.nCandidates = nFiltered[CandidateAccepted];
+  this->stats.nDiameterRejected = nFiltered[CandidateDiameterRejected];
+  this->stats.nPositionRejected = nFiltered[CandidatePositionRejected];
+  this->stats.peakCandidateBytes = candidateBytes;
+  this->stats.timedOut = timedOut;
+  if (timedOut) *this->options.log << "Time limit reached while generating the pairs. " << std::endl;
+  
+  if (this->options.kelbeRegistration)
+  {
+    auto geometricSimilaritySorter = [](const CandidatePair& left, const CandidatePair& right) -> bool
+    {
+        return std::lexicographical_compare(left.verticeDifference, left.verticeDifference + 3,
+                                            right.verticeDifference, right.verticeDifference + 3);
+    };
+    // Stable so that equally similar pairs stay in the deterministic order
+    std::stable_sort(this->candidatePairs.begin(), this->candidatePairs.end(), geometricSimilaritySorter);
+  }
 }
 
-// This is useful for computing the covariance matrix.
-double
-GetMeanOfVector(const Eigen::Vector4d& coords)
+/* Fills the compact record of the pair made of the i-th source triplet and
+   the j-th target triplet. Returns which filter rejected the pair, if any,
+   in which case it doesn't need to be stored. */
+CandidateFilter
+Registration::makeCandidate(size_t i, size_t j, CandidatePair& candidate) const
 {
-  return (coords[0] + coords[1] + coords[2]) / 3;
+  double verticeDifference[3] = {0, 0, 0};
+  if (this->isFourDof())
+  {
+    /* The diameters are corresponding by construction of the pair. The
+       scans being levelled, the horizontal and vertical distances between
+       the two stems are both preserved. */
+    const auto& sourceStems = this->source->getStems();
+    const auto& targetStems = this->target->getStems();
+    Eigen::Vector4d sourceVector = sourceStems[i / sourceStems.size()].getCoords()
+                                   - sourceStems[i % sourceStems.size()].getCoords();
+    Eigen::Vector4d targetVector = targetStems[j / targetStems.size()].getCoords()
+                                   - targetStems[j % targetStems.size()].getCoords();
+    verticeDifference[0] = fabs(sourceVector.head<2>().norm() - targetVector.head<2>().norm());
+    verticeDifference[1] = fabs(sourceVector(2) - targetVector(2));
+  }
+  else
+  {
+    const TripletStems& sourceTriplet = this->source->getTripletStems(i);
+    const TripletStems& targetTriplet = this->target->getTripletStems(j);
+    if (this->diametersNotCorresponding(sourceTriplet, targetTriplet))
+      return CandidateDiameterRejected;
+    TripletVerticeDifference(this->source->getStems().data(), sourceTriplet,
+                             this->target->getStems().data(), targetTriplet,
+                             verticeDifference);
+  }
+  // Don't discriminate using positions if imitating Kelbe et al. registration
+  if (!this->options.kelbeRegistration
+      && !this->pairPositionsAreCorresponding(verticeDifference))
+    return CandidatePositionRejected;
+
+  // Fits, checked by the constructor
+  candidate.sourceGroup = (uint32_t)i;
+  candidate.targetGroup = (uint32_t)j;
+  for (size_t k = 0; k < 3; ++k)
+    candidate.verticeDifference[k] = (float)verticeDifference[k];
+  return CandidateAccepted;
 }
 
-/* This function populate the stem triplets from both the target scan and the source scan.
-   We use the nPerm function to determine all the possible combinations. */
-void
-Registration::generateTriplets(StemMap& stemMap, std::vector<StemGroup>& threePerm)
+/* Builds the pair of a candidate, computes a first transform then see if
+   other stems matches. This is the only place where the stem groups,
+   which grow with the matching stems, are allocated. */
+PairOfStemGroups
+Registration::evaluateCandidate(const CandidatePair& candidate)
 {
-  std::vector<std::set<int>> threePermN = ThreeCombK(stemMap.getStems().size());
-  StemGroup tempTriplet = StemGroup();
+  PairOfStemGroups pair(this->getTargetGroup(candidate.targetGroup),
+                        this->getSourceGroup(candidate.sourceGroup));
+  this->computeTransform(pair);
+  this->RANSACtransform(pair);
+  return pair;
+}
 
-  for (auto it : threePermN)
+/* Fills candidates with the indices of the target triplets that may match
+   the source triplet. Outside of Kelbe's registration, the triplet index
+   discards the ones with a different shape without looking at them. */
+void
+Registration::findTargetCandidates(size_t sourceIndice,
+                                   std::vector<size_t>& candidates) const
+{
+  if (this->isFourDof())
+  {
+    this->findStemPairCandidates(sourceIndice, candidates);
+    return;
+  }
+  if (this->hasLonelyStem(this->source->getTripletStems(sourceIndice))) return;
+  if (this->options.kelbeRegistration)
   {
-    for (auto jt : it)
-      tempTriplet.push_back(&stemMap.getStems()[jt - 1]);
-    threePerm.push_back(tempTriplet);
-    tempTriplet = StemGroup();
+    this->findDiameterCandidates(sourceIndice, candidates);
+    return;
   }
+  this->target->getTripletIndex().findCandidates(
+    this->source->getTripletIndex().getDescriptor(sourceIndice),
+    this->options.diamErrorTol, candidates);
 }
 
-// Population the pairOfStemsTriplets attributes with all possible pairs. Cleanup is done later.
+/* Fills candidates with the indices of the target triplets whose stems,
+   sorted by radius, are in the radius windows of the stems of the source
+   triplet. They are enumerated directly from the windows instead of testing
+   every target triplet. */
 void
-Registration::generatePairs()
+Registration::findDiameterCandidates(size_t sourceIndice,
+                                     std::vector<size_t>& candidates) const
 {
-  #pragma omp parallel for
-  for (size_t i = 0; i < this->threePermSource.size(); ++i)
+  const TripletStems& sourceTriplet = this->source->getTripletStems(sourceIndice);
+  const RadiusIndex& targetRadii = this->target->getRadiusIndex();
+  size_t nTarget = this->target->getStems().size();
+  const RadiusWindow& w0 = this->sourceRadiusWindows[sourceTriplet[0]];
+  const RadiusWindow& w1 = this->sourceRadiusWindows[sourceTriplet[1]];
+  const RadiusWindow& w2 = this->sourceRadiusWindows[sourceTriplet[2]];
+  size_t nBefore = candidates.size();
+  size_t sorted[3];
+
+  // The ranks are increasing in a triplet sorted by radius
+  for (size_t r0 = w0.begin; r0 < w0.end; ++r0)
   {
-    for (size_t j = 0; j < this->threePermTarget.size(); ++j)
+    for (size_t r1 = std::max(w1.begin, r0 + 1); r1 < w1.end; ++r1)
     {
-      PairOfStemGroups tempPair(this->threePermTarget[j],
-                                this->threePermSource[i]);
-
-      // Don't discriminate using positions if imitating Kelbe et al. registration
-      if (!this->diametersNotCorresponding(tempPair)
-          && (this->pairPositionsAreCorresponding(tempPair) || this->kelbeRegistration))
+      for (size_t r2 = std::max(w2.begin, r1 + 1); r2 < w2.end; ++r2)
       {
-        #pragma omp critical
-        {
-          this->pairsOfStemTriplets.push_back(tempPair);
-        }
+        sorted[0] = targetRadii.getIndice(r0);
+        sorted[1] = targetRadii.getIndice(r1);
+        sorted[2] = targetRadii.getIndice(r2);
+        std::sort(sorted, sorted + 3);
+        candidates.push_back(TripletIndice(sorted[0], sorted[1], sorted[2], nTarget));
       }
     }
   }
-  
-  if (this->kelbeRegistration)
+  std::sort(candidates.begin() + nBefore, candidates.end());
+}
+
+/* 4-DOF version of findDiameterCandidates, on pairs of stems. Only the
+   source pairs whose stems are sorted by radius are used, so each pair of
+   stems gives a single hypothesis. The target pairs are enumerated from the
+   radius windows of the two stems, also sorted by radius. */
+void
+Registration::findStemPairCandidates(size_t sourceIndice,
+                                     std::vector<size_t>& candidates) const
+{
+  const RadiusIndex& sourceRadii = this->source->getRadiusIndex();
+  const RadiusIndex& targetRadii = this->target->getRadiusIndex();
+  size_t nSource = this->source->getStems().size();
+  size_t nTarget = this->target->getStems().size();
+  size_t first = sourceIndice / nSource;
+  size_t second = sourceIndice % nSource;
+  if (sourceRadii.getRank(first) >= sourceRadii.getRank(second)) return;
+
+  const RadiusWindow& w0 = this->sourceRadiusWindows[first];
+  const RadiusWindow& w1 = this->sourceRadiusWindows[second];
+  size_t nBefore = candidates.size();
+  for (size_t r0 = w0.begin; r0 < w0.end; ++r0)
   {
-    auto geometricSimilaritySorter = [](PairOfStemGroups& left, PairOfStemGroups& right) -> bool
-    {
-        return left.getVerticeDifference() < right.getVerticeDifference();
-    };
-    std::sort(this->pairsOfStemTriplets.begin(), this->pairsOfStemTriplets.end(), geometricSimilaritySorter);
+    for (size_t r1 = std::max(w1.begin, r0 + 1); r1 < w1.end; ++r1)
+      candidates.push_back(targetRadii.getIndice(r0)*nTarget + targetRadii.getIndice(r1));
   }
+  std::sort(candidates.begin() + nBefore, candidates.end());
 }
 
-// This removes of non-matching (diameter-wise) pair of triplets.
+/* This removes of non-matching (diameter-wise) pair of triplets. A target
+   stem corresponds to a source stem if its rank by radius is in the window
+   of the source stem, so there is no division here. */
 bool
-Registration::diametersNotCorresponding(PairOfStemGroups& pair)
+Registration::diametersNotCorresponding(const TripletStems& sourceTriplet,
+                                        const TripletStems& targetTriplet) const
 {
-  for (size_t i = 0; i < pair.getSourceGroup().size(); ++i)
+  const RadiusIndex& targetRadii = this->target->getRadiusIndex();
+  for (size_t i = 0; i < sourceTriplet.size(); ++i)
   {
-    if (this->relDiamErrorGreaterThanTol(*pair.getSourceGroup()[i],
-                                         *pair.getTargetGroup()[i]))
-      return true;
+    const RadiusWindow& window = this->sourceRadiusWindows[sourceTriplet[i]];
+    size_t rank = targetRadii.getRank(targetTriplet[i]);
+    if (rank < window.begin || rank >= window.end) return true;
   }
   return false;
 }
@@ -351,12 +1367,11 @@ Registration::diametersNotCorresponding(PairOfStemGroups& pair)
    they don't match.
 */
 bool
-Registration::pairPositionsAreCorresponding(PairOfStemGroups& pair)
+Registration::pairPositionsAreCorresponding(const double* verticeDifference) const
 {
-  const std::vector<double> verticeDiffs = pair.getVerticeDifference();
-  for (double diff : verticeDiffs)
+  for (size_t i = 0; i < 3; ++i)
   {
-    if (diff > 2*this->RANSACtol) return false;
+    if (verticeDifference[i] > 2*this->options.RANSACtol) return false;
   }
   return true;
 }
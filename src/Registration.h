@@ -24,11 +24,16 @@
  *  \brief Header file for the Registration class.
  */
 
-#include "PairOfStemGroups.h"
+#include "PreparedStemMap.h"
+#include "TopPairs.h"
+#include <chrono>
+#include <iostream>
+#include <memory>
 #include <numeric>
 #include <list>
 #include <unordered_set>
 #include <set>
+#include <cstdint>
 
 namespace tlr
 {
@@ -38,13 +43,147 @@ typedef std::vector<const Stem*> StemGroup;
 double GetMeanOfVector(const Eigen::Vector4d& coords);
 std::vector<std::set<int>> NCombK(const int n, const int k);
 
+/**
+ * \brief Parameters of the registration algorithm
+ *
+ * The tolerances are the same as the command line ones. The other members
+ * select which variant of the algorithm is run.
+ */
+struct RegistrationOptions
+{
+  double diamErrorTol = 0.25;
+  double RANSACtol = 0.10;
+  bool kelbeRegistration = false;
+  /* Enumerate the pairs of triplets lazily and evaluate them in bounded
+  batches instead of storing all of them first. The memory used stays the
+  same no matter how many stems are in the maps. Ignored by Kelbe's
+  registration, which has to rank every pair before running RANSAC. */
+  bool streaming = false;
+  size_t streamBatchSize = 4096;
+  /* Draw the source triplets (pairs of stems with fourDof) at random, and
+  stop once the probability that none of them was made of stems of the best
+  transform is under 1 - confidence (adaptive RANSAC). 0 evaluates every
+  pair. Ignored by Kelbe's registration and the Hough voting. */
+  double confidence = 0;
+  /* Number of transforms kept by computeBestTransform. More than one lets
+  the user inspect the alternatives of an ambiguous registration. */
+  size_t topK = 1;
+  /* The scans are levelled, so the transform is a rotation about z and a
+  translation. A hypothesis then needs two corresponding stems instead of
+  three. Ignored by Kelbe's registration. */
+  bool fourDof = false;
+  /* Number of largest stems of each map the hypotheses are made from in the
+  hierarchical registration, see HierarchicalRegistration. 0 uses every stem. */
+  size_t coarseStems = 0;
+  /* Iterations of reweighted least squares refining the transforms kept,
+  see PairOfStemGroups::computeReweightedTransform. 0 doesn't refine them. */
+  size_t refineIterations = 0;
+  /* Run RANSAC on a single hypothesis among those whose first transforms are
+  nearly the same, see Registration::bucketOf, and on the others only for
+  the best ones. They add to its support (PairOfStemGroups::getSupport). */
+  bool clusterHypotheses = false;
+  /* Instead of running RANSAC on every pair, each pair votes for the cell
+  of its first transform and RANSAC only runs on the cells with the most
+  votes, see Registration::voteTransforms. Ignored by Kelbe's registration. */
+  bool houghVoting = false;
+  /* Seconds the registration may take, from the construction of Registration,
+  so generating the pairs counts. Past it, the pairs not generated yet are
+  skipped and the best transforms found so far are kept
+  (RegistrationStats::timedOut). 0 has no limit. */
+  double timeLimit = 0;
+  // Where the progress messages and the final report are written
+  std::ostream* log = &std::cout;
+};
+RegistrationOptions MakeOptions(double diamErrorTol, double RANSACtol,
+                                bool kelbeRegistration);
+// False if the registration doesn't use the triplets of the maps (4-DOF)
+bool NeedsTriplets(const RegistrationOptions& options);
+void PrintBestPairs(std::ostream& log, const std::vector<PairOfStemGroups>& bestPairs);
+
+/* Compact record of a pair of triplets which passed the filters, before it is
+   evaluated. The groups are indices in the triplets of the source and
+   target PreparedStemMap. In the 4-DOF registration they are pairs of stems
+   instead, the indice of the first stem times the number of stems plus the
+   indice of the second. The full PairOfStemGroups is only built
+   when the pair is evaluated. */
+struct CandidatePair
+{
+  uint32_t sourceGroup;
+  uint32_t targetGroup;
+  // See PairOfStemGroups::getVerticeDifference. Used to rank the pairs in Kelbe's registration.
+  float verticeDifference[3];
+};
+
+// Outcome of the filters on a pair of triplets, see Registration::makeCandidate
+enum CandidateFilter
+{
+  CandidateAccepted,
+  CandidateDiameterRejected,
+  CandidatePositionRejected
+};
+
+/**
+ * \brief Statistics of a registration, to tune it and find its slow steps
+ *
+ * Times are wall times in seconds. The pairs of triplets go through the
+ * triplet index (or the radius windows in Kelbe's registration), then the
+ * diameter and the position filters. When streaming, the pairs are
+ * generated during RANSAC, whose time includes them.
+ */
+struct RegistrationStats
+{
+  double prepareTime = 0; // Of both maps, even if shared, see PreparedStemMap
+  double lonelyStemsTime = 0;
+  double pairsTime = 0;
+  double ransacTime = 0;
+  double selectionTime = 0;
+  size_t nUnmatchedStems = 0;
+  size_t nSourceTriplets = 0;
+  size_t nTargetTriplets = 0;
+  size_t nIndexCandidates = 0;
+  size_t nDiameterRejected = 0;
+  size_t nPositionRejected = 0;
+  size_t nCandidates = 0;
+  size_t nHypotheses = 0; // Pairs evaluated by RANSAC
+  size_t nClustered = 0;  // Pairs skipped since similar to an evaluated one
+  double meanInliers = 0;
+  size_t peakCandidateBytes = 0;
+  bool timedOut = false; // Stopped by RegistrationOptions::timeLimit
+};
+
+/* Outcome of a registration, for the programs using it as a library (see
+   TargetIndex). The transform maps the source coordinates into the frame of
+   the target. The matches are the indices, in the source and target maps,
+   of the stems the transform was computed from. */
+struct RegistrationResult
+{
+  bool success = false;
+  Eigen::Matrix<double, 4, 4, Eigen::DontAlign> transform = Eigen::Matrix4d::Identity();
+  double meanSquareError = 0;
+  size_t support = 0; // See PairOfStemGroups::getSupport
+  std::vector<std::pair<size_t, size_t>> matches;
+  // The next best transforms, if options.topK is over 1
+  std::vector<Eigen::Matrix<double, 4, 4, Eigen::DontAlign>> alternatives;
+  RegistrationStats stats;
+  std::string report; // Messages and final report of the registration
+  std::string error;  // Why it couldn't be run, see TargetIndex::registerSources
+};
+
+// Ranks, in a RadiusIndex, of the stems whose radius corresponds to a stem.
+struct RadiusWindow
+{
+  size_t begin;
+  size_t end;
+};
+
 /**
  * \brief Container class for the main algorithm
  *
  * This class encapsulate the targetless registration algorithm.
  * To use it, you initialize it and run computeBestTransform. You then
  * run printFinalReport to see the output. Private methode usually represent
- * substeps of the algorithm.
+ * substeps of the algorithm. The maps can be given already prepared, to
+ * share their preprocessing between several registrations.
  */
 class Registration
 {
@@ -53,40 +192,87 @@ class Registration
   Registration(const StemMap& target, const StemMap& source,
                double diamErrorTol, double RANSACtol,
                bool kelbeRegistration);
+  Registration(const StemMap& target, const StemMap& source,
+               const RegistrationOptions& options);
+  Registration(std::shared_ptr<const PreparedStemMap> target,
+               std::shared_ptr<const PreparedStemMap> source,
+               const RegistrationOptions& options);
   ~Registration();
   void computeBestTransform();
   void printFinalReport();
+  void printStats(std::ostream& out) const;
+  const std::vector<PairOfStemGroups>& getBestPairs() const;
+  const RegistrationStats& getStats() const;
+  RegistrationResult getResult() const;
 
  private:
-  unsigned int removeLonelyStems();
-  void generateTriplets(StemMap& stemMap,
-                        std::vector<StemGroup>& threePerm);
+  unsigned int findLonelyStems();
+  bool hasLonelyStem(const TripletStems& sourceTriplet) const;
+  bool isFourDof() const;
+  size_t getNumberOfSourceGroups() const;
+  size_t getNumberOfTargetGroups() const;
+  StemGroup getSourceGroup(size_t indice) const;
+  StemGroup getTargetGroup(size_t indice) const;
   void generatePairs();
+  CandidateFilter makeCandidate(size_t i, size_t j, CandidatePair& candidate) const;
+  PairOfStemGroups evaluateCandidate(const CandidatePair& candidate);
+  void findTargetCandidates(size_t sourceIndice,
+                            std::vector<size_t>& candidates) const;
+  void findDiameterCandidates(size_t sourceIndice,
+                              std::vector<size_t>& candidates) const;
+  void findStemPairCandidates(size_t sourceIndice,
+                              std::vector<size_t>& candidates) const;
+  void computeTransform(PairOfStemGroups& pair) const;
+  void refineBestPairs();
+  TransformCell bucketOf(const CandidatePair& candidate) const;
+  bool evaluateClusters(const CandidatePair* candidates, const size_t* orders, size_t n,
+                        TopPairs& best, size_t& nEvaluated, size_t& nClustered,
+                        size_t& bestInliers, size_t& sumInliers);
+  void streamPairs();
+  bool isStreaming() const;
+  bool isHough() const;
+  void voteTransforms();
+  bool isAdaptive() const;
+  void drawSamples();
+  size_t getNumberOfSamples() const;
+  size_t getSample(size_t rank) const;
+  size_t requiredSamples(size_t nInliers) const;
+  void printStop(size_t nEvaluated, size_t nSamplesDone, size_t nSamples) const;
   // This removes of non-matching pair of triplets.
-  bool diametersNotCorresponding(PairOfStemGroups& pair);
-  bool pairPositionsAreCorresponding(PairOfStemGroups& pair);
+  bool diametersNotCorresponding(const TripletStems& sourceTriplet,
+                                 const TripletStems& targetTriplet) const;
+  bool pairPositionsAreCorresponding(const double* verticeDifference) const;
   void RANSACtransform(PairOfStemGroups& pair);
-  bool stemDistanceGreaterThanTol(const Stem& stem1, const Stem& stem2) const;
-  bool stemAlreadyInGroup(const Stem& stem,
-                          const StemGroup group) const;
   bool relDiamErrorGreaterThanTol(const Stem& stem1, const Stem& stem2) const;
 
-  double diamErrorTol;
-  double RANSACtol;
-  StemMap target;
-  StemMap source;
-  /* These two attributes contains, for each stem map, every way to choose
-  three stem from the map. The complex vector contains the eigenvalues associated
-  with the covariance matrix of the vector. It is here and not in the PairOfStemTriplets
-  class because it would result in the eigenvalues being computed multiplet times
-  for the same triplet which is computationally expensive. */
-  std::vector<StemGroup> threePermTarget;
-  std::vector<StemGroup> threePermSource;
+  RegistrationOptions options;
+  /* The maps with their triplets, indices and grid. They may be shared with
+  other registrations, so they are never modified here. */
+  std::shared_ptr<const PreparedStemMap> target;
+  std::shared_ptr<const PreparedStemMap> source;
+  // For each source stem, the ranks of the target stems with a corresponding
+  // diameter. An empty window means the stem can't be matched.
+  std::vector<RadiusWindow> sourceRadiusWindows;
+  // Number of stems of each map with a corresponding diameter in the other.
+  size_t nMatchedSource;
+  size_t nMatchedTarget;
   /* Contains all possible combinaison of 2 triplets of trees, one from the target
-  and another from the source. Used list because we are going to be deleting
-  a lot of pairs as we go along. */
-  std::vector<PairOfStemGroups> pairsOfStemTriplets;
-  bool kelbeRegistration;
+  and another from the source, that passed the filters. They are stored as
+  compact records since there can be tens of millions of them. */
+  std::vector<CandidatePair> candidatePairs;
+  /* With the adaptive criterion, the source groups in the order they are
+  drawn, and the end in candidatePairs of the pairs of each one. Empty
+  otherwise, the groups being enumerated in order. */
+  std::vector<size_t> samples;
+  std::vector<size_t> sampleEnds;
+  // Result of computeBestTransform, the options.topK best pairs, best first.
+  std::vector<PairOfStemGroups> bestPairs;
+  RegistrationStats stats;
+  // When the registration started, see RegistrationOptions::timeLimit
+  std::chrono::steady_clock::time_point startTime;
+  // Scale of the buckets of transforms, see bucketOf
+  Eigen::Vector3d sourceCenter;
+  double bucketAngle;
 };
 
 } // namespace tlr
@@ -0,0 +1,504 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "RegistrationServer.h"
+#include "StemMapCache.h"
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <omp.h>
+
+namespace tlr
+{
+
+static const size_t MaxRequestLength = 4096;
+static const double RequestTimeout = 5; // Seconds a client has to send its request
+static const int PollTimeout = 100;     // Milliseconds between two checks of the timeouts
+
+// Quoted and escaped for JSON
+static std::string
+JsonString(const std::string& text)
+{
+  std::string quoted = "\"";
+  for (char c : text)
+  {
+    if (c == '"' || c == '\\')
+    {
+      quoted += '\\';
+      quoted += c;
+    }
+    else if ((unsigned char)c < 0x20)
+    {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+      quoted += escaped;
+    }
+    else
+      quoted += c;
+  }
+  return quoted + "\"";
+}
+
+static std::string
+ErrorAnswer(const std::string& status, const std::string& error)
+{
+  return "{\"status\": " + JsonString(status) + ", \"error\": " + JsonString(error) + "}";
+}
+
+static double
+SecondsBetween(std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end)
+{
+  return std::chrono::duration<double>(end - start).count();
+}
+
+// The message of errno, which the calls closing the socket may change
+static std::runtime_error
+SocketError(const std::string& what)
+{
+  return std::runtime_error(what + ": " + strerror(errno));
+}
+
+static sockaddr_un
+SocketAddress(const std::string& path)
+{
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+    throw std::runtime_error("Socket path too long: " + path);
+  memcpy(address.sun_path, path.c_str(), path.size());
+  return address;
+}
+
+// Sends all of text, false if the other end is gone
+static bool
+SendAll(int connection, const std::string& text)
+{
+  size_t sent = 0;
+  while (sent < text.size())
+  {
+    ssize_t n = send(connection, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    sent += n;
+  }
+  return true;
+}
+
+// Up to the first end of line, or to the end of what the other end sends
+static std::string
+ReceiveLine(int connection, size_t maxLength)
+{
+  std::string line;
+  char buffer[512];
+  while (line.size() < maxLength)
+  {
+    ssize_t n = recv(connection, buffer, sizeof(buffer), 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    line.append(buffer, n);
+    size_t end = line.find('\n');
+    if (end != std::string::npos)
+    {
+      line.resize(end);
+      break;
+    }
+  }
+  return line;
+}
+
+std::string
+ServerPath(const std::string& path)
+{
+  return std::filesystem::absolute(path).lexically_normal().string();
+}
+
+std::string
+SendServerRequest(const std::string& socketPath, const std::string& request)
+{
+  sockaddr_un address = SocketAddress(socketPath);
+  int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connection < 0) throw SocketError("Cannot create a socket");
+  if (connect(connection, (sockaddr*)&address, sizeof(address)) < 0)
+  {
+    std::runtime_error error = SocketError("Cannot connect to " + socketPath);
+    close(connection);
+    throw error;
+  }
+
+  std::string answer;
+  if (SendAll(connection, request + "\n"))
+    answer = ReceiveLine(connection, std::string::npos);
+  close(connection);
+  if (answer.empty()) throw std::runtime_error("No answer from " + socketPath);
+  return answer;
+}
+
+RegistrationServer::RegistrationServer(const std::vector<std::string>& referencePaths,
+                                       const RegistrationOptions& options,
+                                       const ServerOptions& serverOptions) :
+  options(options),
+  serverOptions(serverOptions),
+  stopping(false),
+  nRunning(0),
+  nCompleted(0),
+  nExpired(0),
+  nRejected(0),
+  nErrors(0)
+{
+  if (this->serverOptions.nWorkers == 0)
+    throw std::invalid_argument("At least one worker is needed");
+  auto stemMaps = LoadPreparedStemMaps(referencePaths, serverOptions.minDiam,
+                                       options.RANSACtol, serverOptions.cacheDir,
+                                       NeedsTriplets(options));
+  for (size_t i = 0; i < referencePaths.size(); ++i)
+    this->references.emplace(ServerPath(referencePaths[i]), TargetIndex(stemMaps[i], options));
+}
+
+RegistrationServer::~RegistrationServer()
+{
+}
+
+/* Answers the requests sent to socketPath until a shutdown request. The
+   registrations queued by then are still run and answered. */
+void
+RegistrationServer::serve(const std::string& socketPath)
+{
+  sockaddr_un address = SocketAddress(socketPath);
+  // Left by a server which was killed, but never remove another kind of file
+  struct stat status;
+  if (stat(socketPath.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+    unlink(socketPath.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) throw SocketError("Cannot create a socket");
+  if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0
+      || listen(listener, SOMAXCONN) < 0)
+  {
+    std::runtime_error error = SocketError("Cannot listen on " + socketPath);
+    close(listener);
+    throw error;
+  }
+
+  // The workers share the threads, as the jobs of BatchRegistration::run
+  int nThreads = std::max(1, omp_get_max_threads() / (int)this->serverOptions.nWorkers);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < this->serverOptions.nWorkers; ++i)
+    workers.emplace_back(&RegistrationServer::work, this, nThreads);
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::cout << "Listening on " << socketPath << " with "
+              << this->references.size() << " reference stem maps" << std::endl;
+  }
+
+  /* A single thread accepts the connections and reads their requests, as
+     they come in. The listener doesn't block, in case a connection is gone
+     between poll and accept. */
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+  std::vector<PendingConnection> pending;
+  std::vector<pollfd> polled;
+  std::string acceptError;
+  while (!this->stopping) // Only set by this thread, see handleRequest
+  {
+    polled.assign(1, {listener, POLLIN, 0});
+    for (const auto& it : pending) polled.push_back({it.connection, POLLIN, 0});
+    if (poll(polled.data(), polled.size(), PollTimeout) < 0)
+    {
+      if (errno == EINTR) continue;
+      acceptError = SocketError("Cannot wait for the connections").what();
+      break;
+    }
+
+    // In the order of the connections. The new ones are read at the next poll.
+    size_t nPending = 0;
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+      bool timedOut = SecondsBetween(pending[i].accepted, Clock::now()) > RequestTimeout;
+      bool complete = polled[i + 1].revents != 0 && this->receiveRequest(pending[i]);
+      // Complete, or what a client which didn't send its request in time sent
+      if ((complete || timedOut) && !this->stopping)
+        this->handleRequest(pending[i].connection, pending[i].received);
+      else
+        pending[nPending++] = pending[i];
+    }
+    pending.resize(nPending);
+    while (polled[0].revents != 0 && !this->stopping)
+    {
+      int connection = accept(listener, nullptr, nullptr);
+      if (connection >= 0)
+        pending.push_back({connection, std::string(), Clock::now()});
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      else if (errno != EINTR && errno != ECONNABORTED)
+      {
+        acceptError = SocketError("Cannot accept a connection").what();
+        break;
+      }
+    }
+    if (!acceptError.empty()) break;
+  }
+  for (const auto& it : pending)
+    this->answer(it.connection, ErrorAnswer("error", "The server is shutting down"));
+  close(listener);
+  unlink(socketPath.c_str());
+
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->queueChanged.notify_all();
+  for (auto& it : workers) it.join();
+  if (!acceptError.empty()) throw std::runtime_error(acceptError);
+}
+
+/* Reads what a connection sent without waiting, true once its request is
+   complete : up to the first end of line, or to the end of what the client
+   sends, or MaxRequestLength long. */
+bool
+RegistrationServer::receiveRequest(PendingConnection& pending)
+{
+  char buffer[512];
+  ssize_t n = recv(pending.connection, buffer, sizeof(buffer), MSG_DONTWAIT);
+  if (n < 0) return errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK;
+  if (n == 0) return true;
+  pending.received.append(buffer, n);
+  size_t end = pending.received.find('\n');
+  if (end != std::string::npos) pending.received.resize(end);
+  return end != std::string::npos || pending.received.size() >= MaxRequestLength;
+}
+
+/* Answers the request of a connection. The registrations are queued and
+   answered by a worker, the other requests are answered right away. */
+void
+RegistrationServer::handleRequest(int connection, const std::string& line)
+{
+  std::istringstream stream(line.substr(0, MaxRequestLength));
+  std::vector<std::string> args;
+  std::string arg;
+  while (stream >> arg) args.push_back(arg);
+
+  std::string answer;
+  if (args.size() == 1 && args[0] == "status")
+    answer = this->getStatus();
+  else if (args.size() == 1 && args[0] == "shutdown")
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+    answer = "{\"status\": \"ok\"}";
+  }
+  else if (!args.empty() && args[0] == "register")
+  {
+    answer = this->queueRequest(args, connection);
+    if (answer.empty()) return; // Queued, a worker will answer
+  }
+  else
+    answer = ErrorAnswer("error", "Unknown request, expected register, status or shutdown");
+  this->answer(connection, answer);
+}
+
+// Empty if the request was queued, else the answer rejecting it
+std::string
+RegistrationServer::queueRequest(const std::vector<std::string>& args, int connection)
+{
+  Request request;
+  request.connection = connection;
+  request.received = Clock::now();
+  request.deadline = Clock::time_point::max();
+  double deadline = this->serverOptions.deadline;
+  try
+  {
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+      if (args[i] == "--reference" && i + 1 < args.size())
+        request.reference = ServerPath(args[++i]);
+      else if (args[i] == "--deadline" && i + 1 < args.size())
+        deadline = std::stod(args[++i]);
+      else if (request.pathSource.empty() && args[i].compare(0, 2, "--") != 0)
+        request.pathSource = args[i];
+      else
+        return ErrorAnswer("error", "Unknown argument: " + args[i]);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    return ErrorAnswer("error", std::string("Bad deadline: ") + e.what());
+  }
+  if (request.pathSource.empty())
+    return ErrorAnswer("error", "Expected register path_source");
+  if (request.reference.empty() && this->references.size() == 1)
+    request.reference = this->references.begin()->first;
+  if (request.reference.empty())
+    return ErrorAnswer("error", "Several references, expected --reference path_reference");
+  if (this->references.count(request.reference) == 0)
+    return ErrorAnswer("error", "Unknown reference: " + request.reference);
+  if (deadline > 0)
+  {
+    request.deadline = request.received + std::chrono::duration_cast<Clock::duration>(
+                                            std::chrono::duration<double>(deadline));
+  }
+
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if (this->queue.size() >= this->serverOptions.maxQueued)
+  {
+    ++this->nRejected;
+    return ErrorAnswer("rejected", "Too many queued requests");
+  }
+  this->queue.push_back(request);
+  this->queueChanged.notify_one();
+  return "";
+}
+
+std::string
+RegistrationServer::getStatus()
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+  std::ostringstream out;
+  out << "{\"status\": \"ok\", \"queued\": " << this->queue.size()
+      << ", \"running\": " << this->nRunning
+      << ", \"completed\": " << this->nCompleted
+      << ", \"expired\": " << this->nExpired
+      << ", \"rejected\": " << this->nRejected
+      << ", \"errors\": " << this->nErrors
+      << ", \"references\": [";
+  for (auto it = this->references.begin(); it != this->references.end(); ++it)
+    out << (it == this->references.begin() ? "" : ", ") << JsonString(it->first);
+  out << "]}";
+  return out.str();
+}
+
+// Runs the queued registrations, each one with nThreads threads
+void
+RegistrationServer::work(int nThreads)
+{
+  omp_set_num_threads(nThreads);
+  while (true)
+  {
+    Request request;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->queueChanged.wait(lock, [this]() -> bool
+                              {
+                                return this->stopping || !this->queue.empty();
+                              });
+      if (this->queue.empty()) return; // Stopping, and every request answered
+      request = this->queue.front();
+      this->queue.pop_front();
+      ++this->nRunning;
+    }
+
+    Outcome outcome = Expired;
+    std::string answer = Clock::now() >= request.deadline ?
+                         ErrorAnswer("expired", "Deadline passed before a worker was free") :
+                         this->registerRequest(request, outcome);
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      --this->nRunning;
+      if (outcome == Completed)
+        ++this->nCompleted;
+      else if (outcome == Expired)
+        ++this->nExpired;
+      else
+        ++this->nErrors;
+    }
+    this->answer(request.connection, answer);
+  }
+}
+
+/* The answer to a registration request. The transform is given row by row
+   and each match is the indice of a stem in the source and target maps,
+   after the stems under the minimum diameter are removed. The request
+   expires if its deadline passes while the source is prepared, and fails if
+   the source can't be loaded or registered. */
+std::string
+RegistrationServer::registerRequest(const Request& request, Outcome& outcome) const
+{
+  Clock::time_point start = Clock::now();
+  RegistrationResult result;
+  try
+  {
+    auto source = LoadPreparedStemMap(request.pathSource, this->serverOptions.minDiam,
+                                      this->options.RANSACtol, this->serverOptions.cacheDir,
+                                      NeedsTriplets(this->options));
+    if (Clock::now() >= request.deadline)
+    {
+      outcome = Expired;
+      return ErrorAnswer("expired", "Deadline passed while preparing the source");
+    }
+    RegistrationOptions options = this->options;
+    // The time left once the source is ready, but never no limit at all
+    if (request.deadline != Clock::time_point::max())
+      options.timeLimit = std::max(SecondsBetween(Clock::now(), request.deadline), 1e-9);
+    result = this->references.at(request.reference).registerSource(source, options);
+  }
+  catch (const std::exception& e)
+  {
+    result.error = e.what();
+  }
+  outcome = result.error.empty() ? Completed : Failed;
+
+  std::ostringstream out;
+  out.precision(10);
+  out << "{\"status\": " << (result.error.empty() ? "\"ok\"" : "\"error\"")
+      << ", \"source\": " << JsonString(request.pathSource)
+      << ", \"reference\": " << JsonString(request.reference)
+      << ", \"success\": " << (result.success ? "true" : "false")
+      << ", \"transform\": [";
+  for (int i = 0; i < 16; ++i)
+    out << (i == 0 ? "" : ", ") << result.transform(i / 4, i % 4);
+  out << "], \"mean_square_error\": " << result.meanSquareError
+      << ", \"matches\": [";
+  for (size_t i = 0; i < result.matches.size(); ++i)
+  {
+    out << (i == 0 ? "" : ", ") << "[" << result.matches[i].first
+        << ", " << result.matches[i].second << "]";
+  }
+  out << "], \"support\": " << result.support
+      << ", \"timed_out\": " << (result.stats.timedOut ? "true" : "false")
+      << ", \"queued_s\": " << SecondsBetween(request.received, start)
+      << ", \"run_s\": " << SecondsBetween(start, Clock::now());
+  if (!result.error.empty()) out << ", \"error\": " << JsonString(result.error);
+  out << "}";
+  return out.str();
+}
+
+// Sends the answer, which is also logged, and closes the connection
+void
+RegistrationServer::answer(int connection, const std::string& answer)
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::cout << answer << std::endl;
+  }
+  SendAll(connection, answer + "\n");
+  close(connection);
+}
+
+} // namespace tlr
@@ -0,0 +1,131 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef TLR_REGISTRATIONSERVER_H_
+#define TLR_REGISTRATIONSERVER_H_
+
+#include "TargetIndex.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+
+namespace tlr
+{
+
+// Settings of a RegistrationServer, apart from the registration options
+struct ServerOptions
+{
+  double minDiam = 0;    // Of the reference and source maps
+  std::string cacheDir;  // See LoadPreparedStemMap, no cache if empty
+  size_t nWorkers = 1;   // Registrations running at once
+  size_t maxQueued = 16; // Requests waiting for a worker, the next are rejected
+  double deadline = 0;   // Seconds to answer a request if it doesn't say, 0 for none
+};
+
+/* The absolute path the server knows a file by, so the client and the server
+   don't need to run in the same directory. Only lexically normalized, the
+   links aren't followed. */
+std::string ServerPath(const std::string& path);
+
+/* Sends a request to the RegistrationServer listening on socketPath and
+   returns its answer. Throws std::runtime_error if it can't be reached. */
+std::string SendServerRequest(const std::string& socketPath,
+                              const std::string& request);
+
+/**
+ * \brief Registration service keeping reference maps in memory
+ *
+ * The references are loaded and prepared once (see TargetIndex), then the
+ * server answers the requests sent to a Unix domain socket, one line per
+ * connection :
+ *   register path_source [--reference path_reference] [--deadline s]
+ *   status
+ *   shutdown
+ * Each answer is a line of JSON whose "status" is "ok", "expired" (the
+ * deadline passed before a worker was free or while the source was
+ * prepared), "rejected" (the queue is full)
+ * or "error". The requests are read as they come, so a slow client
+ * doesn't hold up the others. The registrations wait in a bounded queue for one of the
+ * workers, and a registration still running at its deadline keeps the best
+ * transform found so far (RegistrationOptions::timeLimit).
+ */
+class RegistrationServer
+{
+ public:
+  RegistrationServer(const std::vector<std::string>& referencePaths,
+                     const RegistrationOptions& options,
+                     const ServerOptions& serverOptions);
+  ~RegistrationServer();
+  void serve(const std::string& socketPath);
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  // How a registration ended, see work
+  enum Outcome
+  {
+    Completed,
+    Expired,
+    Failed
+  };
+
+  // A connection whose request isn't fully received yet
+  struct PendingConnection
+  {
+    int connection;
+    std::string received;
+    Clock::time_point accepted;
+  };
+
+  // A registration waiting for its worker, answered on its connection
+  struct Request
+  {
+    int connection;
+    std::string pathSource;
+    std::string reference;
+    Clock::time_point received;
+    Clock::time_point deadline; // Clock::time_point::max() if none
+  };
+
+  bool receiveRequest(PendingConnection& pending);
+  void handleRequest(int connection, const std::string& line);
+  std::string queueRequest(const std::vector<std::string>& args, int connection);
+  std::string getStatus();
+  void work(int nThreads);
+  std::string registerRequest(const Request& request, Outcome& outcome) const;
+  void answer(int connection, const std::string& answer);
+
+  std::map<std::string, TargetIndex> references; // By ServerPath
+  RegistrationOptions options;
+  ServerOptions serverOptions;
+  std::deque<Request> queue;
+  std::mutex mutex; // Of the queue, the counters and the output
+  std::condition_variable queueChanged;
+  bool stopping;
+  size_t nRunning;
+  size_t nCompleted;
+  size_t nExpired;
+  size_t nRejected;
+  size_t nErrors;
+};
+
+} // namespace tlr
+#endif
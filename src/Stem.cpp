@@ -43,6 +43,14 @@ Stem::Stem(const Stem& stem)
   this->radius = stem.radius;
 }
 
+Stem&
+Stem::operator=(const Stem& stem)
+{
+  this->coords = stem.coords;
+  this->radius = stem.radius;
+  return *this;
+}
+
 Stem::~Stem()
 {
 }
@@ -34,6 +34,7 @@ class Stem
   Stem();
   Stem(double x, double y, double z, double radius);
   Stem(const Stem& stem);
+  Stem& operator=(const Stem& stem);
   ~Stem();
   void changeCoords(const Eigen::Matrix4d& transMatrix);
   // Getters and setters
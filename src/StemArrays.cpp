@@ -0,0 +1,179 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include "StemArrays.h"
+#include <math.h>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace tlr
+{
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+// Indice of the lowest set bit of a non-zero mask
+static inline unsigned int
+CountTrailingZeros(unsigned int mask)
+{
+#if defined(_MSC_VER)
+  unsigned long indice;
+  _BitScanForward(&indice, mask);
+  return indice;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+StemArrays::StemArrays() {}
+
+StemArrays::StemArrays(const StemMap& stemMap)
+{
+  size_t n = stemMap.getStems().size();
+  this->x.reserve(n);
+  this->y.reserve(n);
+  this->z.reserve(n);
+  this->radius.reserve(n);
+  for (const auto& it : stemMap.getStems())
+  {
+    this->x.push_back(it.getCoords()(0));
+    this->y.push_back(it.getCoords()(1));
+    this->z.push_back(it.getCoords()(2));
+    this->radius.push_back(it.getRadius());
+  }
+}
+
+size_t
+StemArrays::size() const
+{
+  return this->x.size();
+}
+
+void
+TransformStems(const StemArrays& stems, const Eigen::Matrix4d& transMatrix,
+               double* x, double* y, double* z)
+{
+  const double* inX = stems.x.data();
+  const double* inY = stems.y.data();
+  const double* inZ = stems.z.data();
+  const Eigen::Matrix4d& T = transMatrix;
+  size_t n = stems.size();
+  size_t i = 0;
+
+#if defined(__AVX512F__)
+  for (; i + 8 <= n; i += 8)
+  {
+    __m512d px = _mm512_loadu_pd(inX + i);
+    __m512d py = _mm512_loadu_pd(inY + i);
+    __m512d pz = _mm512_loadu_pd(inZ + i);
+    for (int row = 0; row < 3; ++row)
+    {
+      // Same operations in the same order as the scalar loop, without FMA,
+      // so every path gives the same coordinates to the last bit
+      __m512d result = _mm512_mul_pd(_mm512_set1_pd(T(row, 0)), px);
+      result = _mm512_add_pd(result, _mm512_mul_pd(_mm512_set1_pd(T(row, 1)), py));
+      result = _mm512_add_pd(result, _mm512_mul_pd(_mm512_set1_pd(T(row, 2)), pz));
+      result = _mm512_add_pd(result, _mm512_set1_pd(T(row, 3)));
+      _mm512_storeu_pd((row == 0 ? x : row == 1 ? y : z) + i, result);
+    }
+  }
+#elif defined(__AVX2__)
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256d px = _mm256_loadu_pd(inX + i);
+    __m256d py = _mm256_loadu_pd(inY + i);
+    __m256d pz = _mm256_loadu_pd(inZ + i);
+    for (int row = 0; row < 3; ++row)
+    {
+      __m256d result = _mm256_mul_pd(_mm256_set1_pd(T(row, 0)), px);
+      result = _mm256_add_pd(result, _mm256_mul_pd(_mm256_set1_pd(T(row, 1)), py));
+      result = _mm256_add_pd(result, _mm256_mul_pd(_mm256_set1_pd(T(row, 2)), pz));
+      result = _mm256_add_pd(result, _mm256_set1_pd(T(row, 3)));
+      _mm256_storeu_pd((row == 0 ? x : row == 1 ? y : z) + i, result);
+    }
+  }
+#endif
+  // Scalar fallback and leftovers
+  for (; i < n; ++i)
+  {
+    x[i] = T(0, 0)*inX[i] + T(0, 1)*inY[i] + T(0, 2)*inZ[i] + T(0, 3);
+    y[i] = T(1, 0)*inX[i] + T(1, 1)*inY[i] + T(1, 2)*inZ[i] + T(1, 3);
+    z[i] = T(2, 0)*inX[i] + T(2, 1)*inY[i] + T(2, 2)*inZ[i] + T(2, 3);
+  }
+}
+
+void
+FindWithinDistance(const Eigen::Vector4d& point,
+                   const double* x, const double* y, const double* z,
+                   size_t n, double tol, std::vector<size_t>& indices)
+{
+  double tol2 = tol*tol;
+  size_t i = 0;
+
+#if defined(__AVX512F__)
+  __m512d px = _mm512_set1_pd(point(0));
+  __m512d py = _mm512_set1_pd(point(1));
+  __m512d pz = _mm512_set1_pd(point(2));
+  __m512d vTol2 = _mm512_set1_pd(tol2);
+  for (; i + 8 <= n; i += 8)
+  {
+    __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(x + i), px);
+    __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(y + i), py);
+    __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(z + i), pz);
+    // No FMA, as in TransformStems, for the same decisions at the tolerance
+    __m512d d2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx),
+                                             _mm512_mul_pd(dy, dy)),
+                               _mm512_mul_pd(dz, dz));
+    unsigned int mask = _mm512_cmp_pd_mask(d2, vTol2, _CMP_LE_OQ);
+    for (; mask; mask &= mask - 1)
+      indices.push_back(i + CountTrailingZeros(mask));
+  }
+#elif defined(__AVX2__)
+  __m256d px = _mm256_set1_pd(point(0));
+  __m256d py = _mm256_set1_pd(point(1));
+  __m256d pz = _mm256_set1_pd(point(2));
+  __m256d vTol2 = _mm256_set1_pd(tol2);
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x + i), px);
+    __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y + i), py);
+    __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(z + i), pz);
+    __m256d d2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx),
+                                             _mm256_mul_pd(dy, dy)),
+                               _mm256_mul_pd(dz, dz));
+    unsigned int mask = _mm256_movemask_pd(_mm256_cmp_pd(d2, vTol2, _CMP_LE_OQ));
+    for (; mask; mask &= mask - 1)
+      indices.push_back(i + CountTrailingZeros(mask));
+  }
+#endif
+  for (; i < n; ++i)
+  {
+    double dx = x[i] - point(0);
+    double dy = y[i] - point(1);
+    double dz = z[i] - point(2);
+    if (dx*dx + dy*dy + dz*dz <= tol2) indices.push_back(i);
+  }
+}
+
+} // namespace tlr
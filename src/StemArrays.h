@@ -0,0 +1,60 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef TLR_STEMARRAYS_H_
+#define TLR_STEMARRAYS_H_
+
+#include "StemMap.h"
+
+namespace tlr
+{
+
+/**
+ * \brief Structure of arrays copy of the stems of a map
+ *
+ * The loops that go over every stem of a map only need the positions and
+ * radii. Keeping each of them contiguous (without the homogeneous 1 of
+ * Stem::getCoords) lets the kernels below process several stems per
+ * instruction. The kernels use AVX-512 or AVX2 when the compiler targets
+ * them (e.g. -march=native) and plain loops otherwise.
+ */
+struct StemArrays
+{
+  StemArrays();
+  explicit StemArrays(const StemMap& stemMap);
+  size_t size() const;
+
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> z;
+  std::vector<double> radius;
+};
+
+// Writes the coordinates of the stems transformed by transMatrix in x, y, z.
+void TransformStems(const StemArrays& stems, const Eigen::Matrix4d& transMatrix,
+                    double* x, double* y, double* z);
+// Appends to indices the i in [0, n) where (x[i], y[i], z[i]) is within tol of point.
+void FindWithinDistance(const Eigen::Vector4d& point,
+                        const double* x, const double* y, const double* z,
+                        size_t n, double tol, std::vector<size_t>& indices);
+
+} // namespace tlr
+#endif
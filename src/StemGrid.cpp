@@ -0,0 +1,116 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include "StemGrid.h"
+#include <algorithm>
+#include <math.h>
+
+namespace tlr
+{
+
+StemGrid::StemGrid() :
+  radius(0),
+  cellSize(1)
+{
+}
+
+StemGrid::StemGrid(const StemMap& stemMap, double radius) :
+  radius(radius),
+  cellSize(radius > 0 ? radius : 1)
+{
+  const auto& mapStems = stemMap.getStems();
+  std::vector<GridCell> stemCells;
+  for (const auto& it : mapStems)
+    stemCells.push_back(this->cellOf(it.getCoords()));
+
+  // Sort the stems by cell so that each cell is a contiguous range
+  for (size_t i = 0; i < mapStems.size(); ++i) this->indices.push_back(i);
+  std::sort(this->indices.begin(), this->indices.end(),
+            [&stemCells](size_t left, size_t right) -> bool
+            {
+              const GridCell& l = stemCells[left];
+              const GridCell& r = stemCells[right];
+              if (l.x != r.x) return l.x < r.x;
+              if (l.y != r.y) return l.y < r.y;
+              if (l.z != r.z) return l.z < r.z;
+              return left < right;
+            });
+
+  for (size_t k = 0; k < this->indices.size(); ++k)
+  {
+    const Stem& stem = mapStems[this->indices[k]];
+    this->stems.x.push_back(stem.getCoords()(0));
+    this->stems.y.push_back(stem.getCoords()(1));
+    this->stems.z.push_back(stem.getCoords()(2));
+    this->stems.radius.push_back(stem.getRadius());
+
+    const GridCell& cell = stemCells[this->indices[k]];
+    if (k == 0 || !(stemCells[this->indices[k - 1]] == cell))
+      this->cells[cell] = {k, k + 1};
+    else
+      this->cells[cell].end = k + 1;
+  }
+}
+
+/* Appends the indices of the stems whose distance to coords is not greater
+   than the radius of the grid, in increasing order. */
+void
+StemGrid::findNeighbours(const Eigen::Vector4d& coords,
+                         std::vector<size_t>& neighbours) const
+{
+  size_t nBefore = neighbours.size();
+  GridCell center = this->cellOf(coords);
+  GridCell cell;
+
+  for (long long dx = -1; dx <= 1; ++dx)
+  {
+    for (long long dy = -1; dy <= 1; ++dy)
+    {
+      for (long long dz = -1; dz <= 1; ++dz)
+      {
+        cell = {center.x + dx, center.y + dy, center.z + dz};
+        auto it = this->cells.find(cell);
+        if (it == this->cells.end()) continue;
+
+        size_t begin = it->second.begin;
+        size_t nFound = neighbours.size();
+        FindWithinDistance(coords, this->stems.x.data() + begin,
+                           this->stems.y.data() + begin,
+                           this->stems.z.data() + begin,
+                           it->second.end - begin, this->radius, neighbours);
+        // Offsets in the cell to indices in the stem map
+        for (size_t k = nFound; k < neighbours.size(); ++k)
+          neighbours[k] = this->indices[begin + neighbours[k]];
+      }
+    }
+  }
+  std::sort(neighbours.begin() + nBefore, neighbours.end());
+}
+
+GridCell
+StemGrid::cellOf(const Eigen::Vector4d& coords) const
+{
+  return {(long long)floor(coords(0) / this->cellSize),
+          (long long)floor(coords(1) / this->cellSize),
+          (long long)floor(coords(2) / this->cellSize)};
+}
+
+} // namespace tlr
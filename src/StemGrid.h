@@ -0,0 +1,66 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef TLR_STEMGRID_H_
+#define TLR_STEMGRID_H_
+
+#include "StemArrays.h"
+#include "HashGrid.h"
+#include <unordered_map>
+
+namespace tlr
+{
+
+/**
+ * \brief Uniform grid over the positions of the stems of a map
+ *
+ * The cells are as wide as the search radius, so the stems close to a
+ * point are all in the 27 cells around it. The stems are copied in a
+ * StemArrays sorted by cell, so the stems of a cell are tested together
+ * by FindWithinDistance. The grid returns indices in the stem map, which
+ * must not change while the grid is used.
+ */
+class StemGrid
+{
+ public:
+  StemGrid();
+  StemGrid(const StemMap& stemMap, double radius);
+  void findNeighbours(const Eigen::Vector4d& coords,
+                      std::vector<size_t>& neighbours) const;
+
+ private:
+  // Range of a cell in stems
+  struct CellRange
+  {
+    size_t begin;
+    size_t end;
+  };
+  GridCell cellOf(const Eigen::Vector4d& coords) const;
+
+  StemArrays stems;
+  std::vector<size_t> indices; // Indice in the stem map of each of the stems
+  std::unordered_map<GridCell, CellRange, GridCellHash> cells;
+  double radius;
+  double cellSize;
+};
+
+} // namespace tlr
+#endif
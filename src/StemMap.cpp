@@ -19,29 +19,42 @@
  ***************************************************************************/
 
 #include "StemMap.h"
+#include "MappedFile.h"
 #include <fstream>
 #include <sstream>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
 
 
 namespace tlr
 {
 
-void Split(const std::string &s, char delim, std::vector<std::string> &elems);
-std::vector<std::string> Split(const std::string &s, char delim);
+const char BinaryStemMapMagic[8] = {'T', 'L', 'R', 'S', 'T', 'E', 'M', '1'};
 
 StemMap::StemMap()
 {
-  this->stems = std::vector<Stem, Eigen::aligned_allocator<Eigen::Vector4f>>();
+  this->stems = std::vector<Stem, Eigen::aligned_allocator<Stem>>();
   this->transMatrix = Eigen::Matrix4d::Identity(); // No transform applied yet
 }
 
 StemMap::StemMap(const StemMap& stemMap)
 {
   this->stems =
-    std::vector<Stem,Eigen::aligned_allocator<Eigen::Vector4f>>(stemMap.stems);
+    std::vector<Stem,Eigen::aligned_allocator<Stem>>(stemMap.stems);
   this->transMatrix = Eigen::Matrix4d(stemMap.transMatrix);
 }
 
+StemMap&
+StemMap::operator=(const StemMap& stemMap)
+{
+  this->stems = stemMap.stems;
+  this->transMatrix = stemMap.transMatrix;
+  return *this;
+}
+
 StemMap::~StemMap()
 {
 }
@@ -49,7 +62,8 @@ StemMap::~StemMap()
 void
 StemMap::applyTransMatrix(const Eigen::Matrix4d& transMatrix)
 {
-  // Could gain significant speedup from parralelization
+  /* Not on the hot path : the registration transforms the StemArrays of the
+     prepared maps instead, see TransformStems. */
   for (auto& it : this->stems)
   {
     it.changeCoords(transMatrix);
@@ -99,55 +113,154 @@ StemMap::operator==(const StemMap &stemMap) const
          stemMap.transMatrix == this->transMatrix;
 }
 
-const std::vector<Stem, Eigen::aligned_allocator<Eigen::Vector4f>>&
+const std::vector<Stem, Eigen::aligned_allocator<Stem>>&
 StemMap::getStems() const
 {
   return this->stems;
 }
 
+/* Loads the stems with a diameter over minDiam. The file is either the
+   text format (x y z DBH on each line) or the binary format, recognized by
+   its first bytes. Either way the file is memory-mapped and parsed in place.
+   Throws std::runtime_error, with the line number for text files, if the
+   file can't be read or is malformed. */
 void
 StemMap::loadStemMapFile(std::string path, double minDiam)
 {
-  std::ifstream stemMapFile(path);
-  std::string line;
-  Stem tempStem;
+  MappedFile file(path);
+  const char* begin = file.getData();
+  const char* end = begin + file.getSize();
+
+  if (file.getSize() >= sizeof(BinaryStemMapMagic)
+      && memcmp(begin, BinaryStemMapMagic, sizeof(BinaryStemMapMagic)) == 0)
+    this->parseBinary(begin, end, path, minDiam);
+  else
+    this->parseText(begin, end, path, minDiam);
+}
+
+/* Parses the lines without copying them, using std::from_chars, so there is
+   no allocation other than the stems themselves. Values are separated by
+   spaces or tabs, blank lines are ignored. */
+void
+StemMap::parseText(const char* begin, const char* end,
+                   const std::string& path, double minDiam)
+{
+  size_t lineNumber = 0;
+  double values[4];
+
+  auto fail = [&](const std::string& message)
+  {
+    throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": " + message);
+  };
+  auto isSpace = [](char c) -> bool { return c == ' ' || c == '\t' || c == '\r'; };
 
-  while (std::getline(stemMapFile, line))
+  for (const char* line = begin; line < end; )
   {
-    std::vector<std::string> lineData = Split(line, ' ');
-    if (std::stod(lineData[3]) > minDiam)
+    ++lineNumber;
+    const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+    if (lineEnd == nullptr) lineEnd = end;
+
+    size_t nValues = 0;
+    const char* it = line;
+    while (true)
+    {
+      while (it < lineEnd && isSpace(*it)) ++it;
+      if (it == lineEnd) break;
+      if (nValues == 4) fail("more than 4 values");
+      auto result = std::from_chars(it, lineEnd, values[nValues]);
+      if (result.ec != std::errc() || (result.ptr < lineEnd && !isSpace(*result.ptr)))
+        fail("invalid number");
+      it = result.ptr;
+      ++nValues;
+    }
+
+    if (nValues != 0) // Not a blank line
     {
-      tempStem = Stem(std::stod(lineData[0]),
-                      std::stod(lineData[1]),
-                      std::stod(lineData[2]),
-                      std::stod(lineData[3]));
-      this->addStem(tempStem);
+      if (nValues != 4) fail("expected 4 values (x y z DBH), got " + std::to_string(nValues));
+      if (values[3] < 0) fail("negative DBH");
+      if (values[3] > minDiam)
+        this->stems.emplace_back(values[0], values[1], values[2], values[3]);
     }
+    line = lineEnd + 1;
   }
 }
 
-/*
-Stack overflow code for splitting string
-Used in StemMap::loadStemMapFile
-*/
 void
-Split(const std::string &s, char delim, std::vector<std::string> &elems)
+StemMap::parseBinary(const char* begin, const char* end,
+                     const std::string& path, double minDiam)
 {
-  std::stringstream ss(s);
-  std::string item;
-  while (std::getline(ss, item, delim)) {
-    elems.push_back(item);
+  uint64_t nStems;
+  const char* header = begin + sizeof(BinaryStemMapMagic);
+  if (end - header < (long)sizeof(nStems))
+    throw std::runtime_error(path + ": truncated binary stem map");
+  memcpy(&nStems, header, sizeof(nStems));
+
+  const char* arrays = header + sizeof(nStems);
+  if ((uint64_t)(end - arrays) / (4*sizeof(double)) < nStems)
+    throw std::runtime_error(path + ": truncated binary stem map");
+
+  // The file is page-aligned and the header is 16 bytes, so the arrays are
+  // aligned for doubles and are read in place.
+  const double* x = (const double*)arrays;
+  const double* y = x + nStems;
+  const double* z = y + nStems;
+  const double* radius = z + nStems;
+  for (uint64_t i = 0; i < nStems; ++i)
+  {
+    if (radius[i] < 0)
+      throw std::runtime_error(path + ": negative DBH for stem " + std::to_string(i));
+    if (radius[i] > minDiam)
+      this->stems.emplace_back(x[i], y[i], z[i], radius[i]);
   }
 }
 
+// Writes the stems in the binary format read by loadStemMapFile.
+void
+StemMap::saveBinaryStemMapFile(const std::string& path) const
+{
+  std::ofstream file(path, std::ios::binary);
+  if (!file) throw std::runtime_error(path + ": can't open file for writing");
 
-std::vector<std::string>
-Split(const std::string &s, char delim)
+  uint64_t nStems = this->stems.size();
+  file.write(BinaryStemMapMagic, sizeof(BinaryStemMapMagic));
+  file.write((const char*)&nStems, sizeof(nStems));
+  for (int coord = 0; coord < 4; ++coord)
+  {
+    for (const auto& it : this->stems)
+    {
+      double value = coord < 3 ? it.getCoords()(coord) : it.getRadius();
+      file.write((const char*)&value, sizeof(value));
+    }
+  }
+  if (!file) throw std::runtime_error(path + ": error while writing");
+}
+
+/* Loads several stem map files in parallel. If any of them fails, the error
+   of the first one in the list is thrown once all are done. */
+std::vector<StemMap>
+LoadStemMapFiles(const std::vector<std::string>& paths, double minDiam)
 {
-  std::vector<std::string> elems;
-  Split(s, delim, elems);
-  return elems;
+  std::vector<StemMap> stemMaps(paths.size());
+  std::vector<std::exception_ptr> errors(paths.size());
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < paths.size(); ++i)
+  {
+    try
+    {
+      stemMaps[i].loadStemMapFile(paths[i], minDiam);
+    }
+    catch (...)
+    {
+      errors[i] = std::current_exception();
+    }
+  }
+
+  for (const auto& it : errors)
+  {
+    if (it) std::rethrow_exception(it);
+  }
+  return stemMaps;
 }
-// End of stackoverflow code
 
 } // namespace tlr
@@ -35,15 +35,17 @@ class StemMap
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
   StemMap();
   StemMap(const StemMap& stemMap);
+  StemMap& operator=(const StemMap& stemMap);
   ~StemMap();
 
   void loadStemMapFile(std::string path, double minDiam);
+  void saveBinaryStemMapFile(const std::string& path) const;
   void applyTransMatrix(const Eigen::Matrix4d& transMatrix);
   void addStem(Stem& stem);
   void restoreOriginalCoords();
   std::string strStemMap() const;
   bool operator==(const StemMap& stemMap) const;
-  const std::vector<Stem, Eigen::aligned_allocator<Eigen::Vector4f>>& getStems() const;
+  const std::vector<Stem, Eigen::aligned_allocator<Stem>>& getStems() const;
   void removeStem(size_t indice);
 
  private:
@@ -52,9 +54,21 @@ class StemMap
   maybe compiling with C++14 or C++17 will fix it. Source :
   https://eigen.tuxfamily.org/dox/group__TopicStlContainers.html
   */
-  std::vector<Stem,Eigen::aligned_allocator<Eigen::Vector4f>> stems;
+  std::vector<Stem,Eigen::aligned_allocator<Stem>> stems;
   Eigen::Matrix4d transMatrix; // Transformation matrix since the original
+  void parseText(const char* begin, const char* end,
+                 const std::string& path, double minDiam);
+  void parseBinary(const char* begin, const char* end,
+                   const std::string& path, double minDiam);
 };
 
+/* Binary stem map files start with these 8 bytes, followed by the number of
+   stems (uint64) then the x, y, z and radius arrays (doubles), all in the
+   byte order of the machine which wrote it. */
+extern const char BinaryStemMapMagic[8];
+
+std::vector<StemMap> LoadStemMapFiles(const std::vector<std::string>& paths,
+                                      double minDiam);
+
 } // namespace tlr
 #endif
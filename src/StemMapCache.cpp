@@ -0,0 +1,264 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "StemMapCache.h"
+#include "MappedFile.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <stdexcept>
+
+namespace tlr
+{
+
+const char StemMapCacheMagic[8] = {'T', 'L', 'R', 'C', 'A', 'C', 'H', '2'};
+
+struct CacheHeader
+{
+  char magic[8];
+  uint64_t key;
+  double minDiam;
+  uint64_t nStems;
+  uint64_t nTriplets;
+  double sideTol; // Of the triplet index
+  uint64_t nSlots;
+};
+
+// 64-bit FNV-1a, continuing from hash
+static uint64_t
+HashBytes(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+  for (size_t i = 0; i < size; ++i)
+  {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Key of a stem map file in the cache : a hash of its content and minDiam.
+static uint64_t
+CacheKey(const std::string& path, double minDiam)
+{
+  MappedFile file(path);
+  uint64_t hash = HashBytes(file.getData(), file.getSize());
+  return HashBytes((const char*)&minDiam, sizeof(minDiam), hash);
+}
+
+/* The file is named after the key, so a stem map file which changes gets a
+   new cache file and the old one is never read again. */
+static std::string
+CachePath(const std::string& cacheDir, uint64_t key)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.tlrcache", (unsigned long long)key);
+  return cacheDir + "/" + name;
+}
+
+/* Restores a prepared map from its cache file. The triplets, their
+   descriptors and their index are used in place in the mapped file, which
+   stays mapped as long as the map. The index is only rebuilt, from the
+   descriptors, if it was written for another RANSACtol. Returns nullptr if
+   there is no such file or if it doesn't hold what is expected, it is then
+   rebuilt. */
+static std::shared_ptr<const PreparedStemMap>
+ReadCache(const std::string& cachePath, uint64_t key, double minDiam,
+          double RANSACtol)
+{
+  std::shared_ptr<const MappedFile> file;
+  try
+  {
+    file = std::make_shared<const MappedFile>(cachePath);
+  }
+  catch (const std::exception&)
+  {
+    return nullptr; // Not cached yet
+  }
+
+  CacheHeader header;
+  if (file->getSize() < sizeof(header)) return nullptr;
+  memcpy(&header, file->getData(), sizeof(header));
+  if (memcmp(header.magic, StemMapCacheMagic, sizeof(header.magic)) != 0
+      || header.key != key || header.minDiam != minDiam
+      || header.nStems > UINT32_MAX || header.nTriplets > UINT32_MAX
+      || header.nSlots == 0 || (header.nSlots & (header.nSlots - 1)) != 0
+      || header.nSlots > file->getSize())
+    return nullptr;
+  uint64_t expectedSize = sizeof(header) + header.nStems*4*sizeof(double)
+                          + header.nTriplets*(sizeof(TripletDescriptor) + sizeof(uint32_t)
+                                              + sizeof(TripletStems))
+                          + header.nSlots*sizeof(TripletIndex::Slot);
+  if (file->getSize() != expectedSize) return nullptr;
+
+  const double* x = (const double*)(file->getData() + sizeof(header));
+  const double* y = x + header.nStems;
+  const double* z = y + header.nStems;
+  const double* radius = z + header.nStems;
+  const TripletDescriptor* descriptors = (const TripletDescriptor*)(radius + header.nStems);
+  const TripletIndex::Slot* slots = (const TripletIndex::Slot*)(descriptors + header.nTriplets);
+  const uint32_t* members = (const uint32_t*)(slots + header.nSlots);
+  const TripletStems* triplets = (const TripletStems*)(members + header.nTriplets);
+  // A corrupted file mustn't make the registration read out of the arrays
+  for (uint64_t i = 0; i < header.nTriplets; ++i)
+  {
+    for (uint32_t it : triplets[i])
+    {
+      if (it >= header.nStems) return nullptr;
+    }
+    if (members[i] >= header.nTriplets) return nullptr;
+  }
+  for (uint64_t i = 0; i < header.nSlots; ++i)
+  {
+    if (slots[i].begin > header.nTriplets
+        || slots[i].count > header.nTriplets - slots[i].begin)
+      return nullptr;
+  }
+
+  StemMap stemMap;
+  for (uint64_t i = 0; i < header.nStems; ++i)
+  {
+    Stem stem(x[i], y[i], z[i], radius[i]);
+    stemMap.addStem(stem);
+  }
+  double sideTol = 2*RANSACtol;
+  TripletIndex index = header.sideTol == sideTol ?
+                       TripletIndex(descriptors, header.nTriplets, sideTol,
+                                    slots, header.nSlots, members) :
+                       TripletIndex(descriptors, header.nTriplets, sideTol);
+  return std::make_shared<const PreparedStemMap>(stemMap, RANSACtol, file, triplets,
+                                                 std::move(index));
+}
+
+/* Writes the cache file of a prepared map. It is written under a temporary
+   name then renamed, so a concurrent reader never sees it half written. A
+   failure only means the map isn't cached. */
+static void
+WriteCache(const std::string& cachePath, uint64_t key, double minDiam,
+           const PreparedStemMap& prepared)
+{
+  const auto& stems = prepared.getStems();
+  const TripletIndex& index = prepared.getTripletIndex();
+  size_t nTriplets = prepared.getNumberOfTriplets();
+  CacheHeader header;
+  memcpy(header.magic, StemMapCacheMagic, sizeof(header.magic));
+  header.key = key;
+  header.minDiam = minDiam;
+  header.nStems = stems.size();
+  header.nTriplets = nTriplets;
+  header.sideTol = index.getSideTol();
+  header.nSlots = index.getNumberOfSlots();
+
+  std::string tempPath = cachePath + ".tmp"
+    + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+  {
+    std::ofstream file(tempPath, std::ios::binary);
+    file.write((const char*)&header, sizeof(header));
+    for (int coord = 0; coord < 4; ++coord)
+    {
+      for (const auto& it : stems)
+      {
+        double value = coord < 3 ? it.getCoords()(coord) : it.getRadius();
+        file.write((const char*)&value, sizeof(value));
+      }
+    }
+    file.write((const char*)index.getDescriptors(), nTriplets*sizeof(TripletDescriptor));
+    file.write((const char*)index.getSlots(), header.nSlots*sizeof(TripletIndex::Slot));
+    file.write((const char*)index.getMembers(), nTriplets*sizeof(uint32_t));
+    if (nTriplets > 0)
+    {
+      file.write((const char*)&prepared.getTripletStems(0),
+                 nTriplets*sizeof(TripletStems));
+    }
+    if (!file)
+    {
+      file.close();
+      std::remove(tempPath.c_str());
+      return;
+    }
+  }
+  if (std::rename(tempPath.c_str(), cachePath.c_str()) != 0)
+    std::remove(tempPath.c_str());
+}
+
+/* Loads and prepares a stem map. With a cache directory, a map already
+   prepared with the same file content and minDiam is restored from its cache
+   file, whose triplets, descriptors and triplet index are used in place :
+   only the steps linear in the number of stems are done again. Otherwise it
+   is prepared and its cache file written. */
+std::shared_ptr<const PreparedStemMap>
+LoadPreparedStemMap(const std::string& path, double minDiam, double RANSACtol,
+                    const std::string& cacheDir, bool withTriplets)
+{
+  // Without the triplets there is little to save by caching
+  if (cacheDir.empty() || !withTriplets)
+  {
+    StemMap stemMap;
+    stemMap.loadStemMapFile(path, minDiam);
+    return std::make_shared<const PreparedStemMap>(stemMap, RANSACtol, withTriplets);
+  }
+
+  uint64_t key = CacheKey(path, minDiam);
+  std::string cachePath = CachePath(cacheDir, key);
+  std::shared_ptr<const PreparedStemMap> prepared = ReadCache(cachePath, key, minDiam,
+                                                              RANSACtol);
+  if (prepared) return prepared;
+
+  StemMap stemMap;
+  stemMap.loadStemMapFile(path, minDiam);
+  prepared = std::make_shared<const PreparedStemMap>(stemMap, RANSACtol);
+  WriteCache(cachePath, key, minDiam, *prepared);
+  return prepared;
+}
+
+/* Loads and prepares several stem maps in parallel, like LoadStemMapFiles. If
+   any of them fails, the error of the first one in the list is thrown once
+   all are done. */
+std::vector<std::shared_ptr<const PreparedStemMap>>
+LoadPreparedStemMaps(const std::vector<std::string>& paths, double minDiam,
+                     double RANSACtol, const std::string& cacheDir,
+                     bool withTriplets)
+{
+  std::vector<std::shared_ptr<const PreparedStemMap>> prepared(paths.size());
+  std::vector<std::exception_ptr> errors(paths.size());
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < paths.size(); ++i)
+  {
+    try
+    {
+      prepared[i] = LoadPreparedStemMap(paths[i], minDiam, RANSACtol, cacheDir,
+                                        withTriplets);
+    }
+    catch (...)
+    {
+      errors[i] = std::current_exception();
+    }
+  }
+
+  for (const auto& it : errors)
+  {
+    if (it) std::rethrow_exception(it);
+  }
+  return prepared;
+}
+
+} // namespace tlr
@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef TLR_STEMMAPCACHE_H_
+#define TLR_STEMMAPCACHE_H_
+
+#include "PreparedStemMap.h"
+#include <memory>
+
+namespace tlr
+{
+
+/* Cache files start with these 8 bytes, followed by the cache key (uint64),
+   the minimum diameter (double), the number of stems and of triplets
+   (uint64), the side tolerance of the triplet index (double), its number of
+   slots (uint64), the x, y, z and radius arrays of the stems (doubles), the
+   descriptor of each triplet (TripletDescriptor), the slots of the index
+   (TripletIndex::Slot), the triplets of its cells (uint32) and the indices
+   of the three stems of each triplet (TripletStems), all in the byte order
+   of the machine which wrote it. Everything is aligned for its type, so the
+   file is used in place once mapped. */
+extern const char StemMapCacheMagic[8];
+
+std::shared_ptr<const PreparedStemMap>
+LoadPreparedStemMap(const std::string& path, double minDiam, double RANSACtol,
+                    const std::string& cacheDir, bool withTriplets = true);
+std::vector<std::shared_ptr<const PreparedStemMap>>
+LoadPreparedStemMaps(const std::vector<std::string>& paths, double minDiam,
+                     double RANSACtol, const std::string& cacheDir,
+                     bool withTriplets = true);
+
+} // namespace tlr
+#endif
@@ -0,0 +1,145 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include "SyntheticForest.h"
+#include <math.h>
+#include <random>
+
+namespace tlr
+{
+
+SyntheticForest::SyntheticForest(const SyntheticForestOptions& options)
+{
+  std::mt19937 generator(options.seed);
+  double side = sqrt(options.nStems / options.density);
+  std::uniform_real_distribution<double> position(0, side);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::weibull_distribution<double> dbh(options.dbhShape, options.dbhScale);
+  std::normal_distribution<double> noise(0, 1);
+
+  /* Stems placed one at a time, rejecting the positions too close to a stem
+     already placed. Gives up on a stem after a number of tries, so a density
+     too high for the spacing ends up with fewer stems instead of looping. */
+  std::vector<Eigen::Vector3d> positions;
+  std::vector<double> dbhs;
+  for (size_t i = 0; i < options.nStems; ++i)
+  {
+    for (int tries = 0; tries < 100; ++tries)
+    {
+      double x = position(generator);
+      double y = position(generator);
+      bool tooClose = false;
+      for (const auto& it : positions)
+      {
+        if ((it.head<2>() - Eigen::Vector2d(x, y)).norm() < options.minSpacing)
+        {
+          tooClose = true;
+          break;
+        }
+      }
+      if (tooClose) continue;
+      positions.push_back(Eigen::Vector3d(x, y, options.groundSlope*x + 0.1*noise(generator)));
+      dbhs.push_back(std::max(options.minDBH, dbh(generator)));
+      break;
+    }
+  }
+
+  // Random heading, small tilt and translation
+  std::uniform_real_distribution<double> angle(-M_PI, M_PI);
+  std::uniform_real_distribution<double> tilt(-options.maxTilt, options.maxTilt);
+  std::uniform_real_distribution<double> translation(-options.maxTranslation,
+                                                     options.maxTranslation);
+  Eigen::Matrix3d rotation = (Eigen::AngleAxisd(angle(generator), Eigen::Vector3d::UnitZ())
+                              *Eigen::AngleAxisd(tilt(generator), Eigen::Vector3d::UnitX())
+                              *Eigen::AngleAxisd(tilt(generator), Eigen::Vector3d::UnitY()))
+                             .toRotationMatrix();
+  this->transform = Eigen::Matrix4d::Identity();
+  this->transform.block<3, 3>(0, 0) = rotation;
+  this->transform.block<3, 1>(0, 3) = Eigen::Vector3d(translation(generator),
+                                                      translation(generator),
+                                                      0.1*translation(generator));
+  Eigen::Matrix4d inverse = this->transform.inverse();
+
+  // Each scan detects the stems with noise, in its own frame
+  auto scan = [&](StemMap& stemMap, const Eigen::Matrix4d& toScan)
+  {
+    for (size_t i = 0; i < positions.size(); ++i)
+    {
+      if (uniform(generator) < options.missedDetections) continue;
+      Eigen::Vector4d coords = toScan*positions[i].homogeneous();
+      Stem stem(coords(0) + options.positionNoise*noise(generator),
+                coords(1) + options.positionNoise*noise(generator),
+                coords(2) + options.positionNoise*noise(generator),
+                std::max(0.0, dbhs[i]/2*(1 + options.dbhNoise*noise(generator))));
+      stemMap.addStem(stem);
+    }
+    size_t nFalse = (size_t)round(options.falseStems*positions.size());
+    for (size_t i = 0; i < nFalse; ++i)
+    {
+      double x = position(generator);
+      double y = position(generator);
+      Eigen::Vector4d coords = toScan*Eigen::Vector4d(x, y, options.groundSlope*x, 1);
+      Stem stem(coords(0), coords(1), coords(2), std::max(options.minDBH, dbh(generator))/2);
+      stemMap.addStem(stem);
+    }
+  };
+  scan(this->target, Eigen::Matrix4d::Identity());
+  scan(this->source, inverse);
+}
+
+SyntheticForest::~SyntheticForest()
+{
+}
+
+const StemMap&
+SyntheticForest::getTarget() const
+{
+  return this->target;
+}
+
+const StemMap&
+SyntheticForest::getSource() const
+{
+  return this->source;
+}
+
+const Eigen::Matrix4d&
+SyntheticForest::getTransform() const
+{
+  return this->transform;
+}
+
+void
+TransformError(const Eigen::Matrix4d& estimated, const Eigen::Matrix4d& truth,
+               const StemMap& stemMap, double& angle, double& distance,
+               double& stemError)
+{
+  Eigen::Matrix3d rotation = estimated.block<3, 3>(0, 0).transpose()*truth.block<3, 3>(0, 0);
+  double cosAngle = (rotation.trace() - 1)/2;
+  angle = acos(std::min(1.0, std::max(-1.0, cosAngle)))*180/M_PI;
+  distance = (estimated.block<3, 1>(0, 3) - truth.block<3, 1>(0, 3)).norm();
+
+  double sum = 0;
+  for (const auto& it : stemMap.getStems())
+    sum += ((estimated - truth)*it.getCoords()).squaredNorm();
+  stemError = stemMap.getStems().empty() ? 0 : sqrt(sum / stemMap.getStems().size());
+}
+
+} // namespace tlr
@@ -0,0 +1,84 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef TLR_SYNTHETICFOREST_H_
+#define TLR_SYNTHETICFOREST_H_
+
+#include "StemMap.h"
+
+namespace tlr
+{
+
+/* Parameters of a synthetic plot. Distances are in meters, the density in
+   stems per square meter. */
+struct SyntheticForestOptions
+{
+  size_t nStems = 100;
+  double density = 0.04;          // 400 stems per hectare
+  double minSpacing = 1.0;        // No two stems closer than that
+  double dbhShape = 2.5;          // Weibull distribution of the DBH
+  double dbhScale = 0.25;
+  double minDBH = 0.05;
+  double groundSlope = 0.05;      // Height of the stems along x
+  double positionNoise = 0.02;    // Standard deviation, on each coordinate
+  double dbhNoise = 0.03;         // Standard deviation, relative
+  double missedDetections = 0.15; // Probability, in each scan
+  double falseStems = 0.05;       // Proportion of stems, in each scan
+  double maxTranslation = 20;     // Of the source scan relative to the target
+  double maxTilt = 0.02;          // Radians, the scans are nearly level
+  unsigned int seed = 1;
+};
+
+/**
+ * \brief Pair of stem maps of the same simulated plot, with a known transform
+ *
+ * The stems are placed uniformly with a minimum spacing and their DBH
+ * follows a Weibull distribution, as in a natural stand. Each scan misses
+ * some stems and detects some that don't exist, and its positions and DBH
+ * are noisy. The source scan is moved by a random rigid transform, the
+ * ground truth of its registration to the target scan. The same options
+ * give the same maps.
+ */
+class SyntheticForest
+{
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  explicit SyntheticForest(const SyntheticForestOptions& options);
+  ~SyntheticForest();
+  const StemMap& getTarget() const;
+  const StemMap& getSource() const;
+  // Maps the coordinates of the source scan into the frame of the target
+  const Eigen::Matrix4d& getTransform() const;
+
+ private:
+  StemMap target;
+  StemMap source;
+  Eigen::Matrix4d transform;
+};
+
+/* Error of an estimated transform : the angle (in degrees) and the distance
+   between it and the true one, and the root mean square distance between
+   the stems of stemMap moved by each. */
+void TransformError(const Eigen::Matrix4d& estimated, const Eigen::Matrix4d& truth,
+                    const StemMap& stemMap, double& angle, double& distance,
+                    double& stemError);
+
+} // namespace tlr
+#endif
@@ -0,0 +1,121 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include "TargetIndex.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace tlr
+{
+
+TargetIndex::TargetIndex(const StemMap& target, const RegistrationOptions& options) :
+  TargetIndex(std::make_shared<const PreparedStemMap>(target, options.RANSACtol,
+                                                      NeedsTriplets(options)),
+              options)
+{
+}
+
+// From a map already prepared, for instance restored from the cache
+TargetIndex::TargetIndex(std::shared_ptr<const PreparedStemMap> target,
+                         const RegistrationOptions& options) :
+  target(target),
+  options(options)
+{
+  if (this->options.coarseStems > 0)
+    throw std::invalid_argument("Hierarchical registration isn't supported by the server");
+  if (this->target->getRANSACtol() != this->options.RANSACtol)
+    throw std::invalid_argument("Target prepared for another RANSAC tolerance");
+  if (NeedsTriplets(this->options) && !this->target->hasTriplets())
+    throw std::invalid_argument("Target prepared without its triplets");
+}
+
+TargetIndex::~TargetIndex()
+{
+}
+
+RegistrationResult
+TargetIndex::registerSource(const StemMap& source) const
+{
+  return this->registerSource(std::make_shared<const PreparedStemMap>(
+    source, this->options.RANSACtol, NeedsTriplets(this->options)));
+}
+
+RegistrationResult
+TargetIndex::registerSource(std::shared_ptr<const PreparedStemMap> source) const
+{
+  return this->registerSource(source, this->options);
+}
+
+/* With other options than those of the index, for instance a time limit.
+   The target must have been prepared for them, see the constructor. */
+RegistrationResult
+TargetIndex::registerSource(std::shared_ptr<const PreparedStemMap> source,
+                            const RegistrationOptions& options) const
+{
+  if (options.RANSACtol != this->options.RANSACtol)
+    throw std::invalid_argument("Target prepared for another RANSAC tolerance");
+  std::ostringstream report;
+  RegistrationOptions registrationOptions = options;
+  registrationOptions.log = &report;
+
+  Registration reg(this->target, source, registrationOptions);
+  reg.computeBestTransform();
+  reg.printFinalReport();
+  RegistrationResult result = reg.getResult();
+  result.report = report.str();
+  return result;
+}
+
+/* Registers the sources concurrently, one per thread, so their own parallel
+   steps run on a single thread unless nested parallelism is enabled. A
+   source which can't be registered gets its error in its result instead of
+   stopping the others. The results are in the order of the sources. */
+std::vector<RegistrationResult>
+TargetIndex::registerSources(const std::vector<StemMap>& sources) const
+{
+  std::vector<RegistrationResult> results(sources.size());
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < sources.size(); ++i)
+  {
+    try
+    {
+      results[i] = this->registerSource(sources[i]);
+    }
+    catch (const std::exception& e)
+    {
+      results[i].error = e.what();
+    }
+  }
+  return results;
+}
+
+const PreparedStemMap&
+TargetIndex::getTarget() const
+{
+  return *this->target;
+}
+
+const RegistrationOptions&
+TargetIndex::getOptions() const
+{
+  return this->options;
+}
+
+} // namespace tlr
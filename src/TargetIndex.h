@@ -0,0 +1,63 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef TLR_TARGETINDEX_H_
+#define TLR_TARGETINDEX_H_
+
+#include "Registration.h"
+
+namespace tlr
+{
+
+/**
+ * \brief Library API registering many source scans to one target scan
+ *
+ * The target is prepared once (see PreparedStemMap) with the options given
+ * at construction, then each source is registered to it without redoing any
+ * target-side work. A TargetIndex is immutable, so registerSource may be
+ * called from several threads at once. Each registration writes its
+ * messages in its RegistrationResult instead of options.log.
+ *
+ * \code
+ * tlr::TargetIndex index(reference, options);
+ * std::vector<tlr::RegistrationResult> results = index.registerSources(scans);
+ * \endcode
+ */
+class TargetIndex
+{
+ public:
+  TargetIndex(const StemMap& target, const RegistrationOptions& options);
+  TargetIndex(std::shared_ptr<const PreparedStemMap> target,
+              const RegistrationOptions& options);
+  ~TargetIndex();
+  RegistrationResult registerSource(const StemMap& source) const;
+  RegistrationResult registerSource(std::shared_ptr<const PreparedStemMap> source) const;
+  RegistrationResult registerSource(std::shared_ptr<const PreparedStemMap> source,
+                                    const RegistrationOptions& options) const;
+  std::vector<RegistrationResult> registerSources(const std::vector<StemMap>& sources) const;
+  const PreparedStemMap& getTarget() const;
+  const RegistrationOptions& getOptions() const;
+
+ private:
+  std::shared_ptr<const PreparedStemMap> target;
+  RegistrationOptions options;
+};
+
+} // namespace tlr
+#endif
@@ -0,0 +1,114 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include "TopPairs.h"
+#include <algorithm>
+
+namespace tlr
+{
+
+TopPairs::TopPairs(size_t k) :
+  k(k)
+{
+  this->ranked.reserve(k + 1);
+}
+
+void
+TopPairs::add(const PairOfStemGroups& pair, size_t order)
+{
+  this->insert(pair, order);
+}
+
+void
+TopPairs::merge(const TopPairs& other)
+{
+  for (const auto& it : other.ranked) this->insert(it.pair, it.order, &it.matches);
+}
+
+std::vector<PairOfStemGroups>
+TopPairs::getPairs() const
+{
+  std::vector<PairOfStemGroups> pairs;
+  for (const auto& it : this->ranked) pairs.push_back(it.pair);
+  return pairs;
+}
+
+// Orders of the pairs given to add, in the same order as getPairs
+std::vector<size_t>
+TopPairs::getOrders() const
+{
+  std::vector<size_t> orders;
+  for (const auto& it : this->ranked) orders.push_back(it.order);
+  return orders;
+}
+
+/* Insertion in the sorted list, which is at most k long. The pair is only
+   copied if it is kept, most evaluated pairs being worse than the k best.
+   A pair with the same matches as a kept one replaces it if it is better
+   and is dropped otherwise. */
+void
+TopPairs::insert(const PairOfStemGroups& pair, size_t order, const Matches* knownMatches)
+{
+  if (this->k == 0) return;
+  if (this->ranked.size() == this->k
+      && !better(pair, order, this->ranked.back().pair, this->ranked.back().order))
+    return;
+
+  Matches matches = knownMatches ? *knownMatches : getMatches(pair);
+  for (auto it = this->ranked.begin(); it != this->ranked.end(); ++it)
+  {
+    if (it->matches != matches) continue;
+    if (!better(pair, order, it->pair, it->order)) return;
+    this->ranked.erase(it);
+    break;
+  }
+
+  auto position = std::upper_bound(this->ranked.begin(), this->ranked.end(), order,
+                                   [&pair](size_t order, const RankedPair& other) -> bool
+                                   {
+                                     return better(pair, order, other.pair, other.order);
+                                   });
+  this->ranked.insert(position, RankedPair{pair, order, std::move(matches)});
+  if (this->ranked.size() > this->k) this->ranked.pop_back();
+}
+
+bool
+TopPairs::better(const PairOfStemGroups& left, size_t leftOrder,
+                 const PairOfStemGroups& right, size_t rightOrder)
+{
+  if (left < right) return true;
+  if (right < left) return false;
+  return leftOrder < rightOrder;
+}
+
+TopPairs::Matches
+TopPairs::getMatches(const PairOfStemGroups& pair)
+{
+  const StemGroup& source = pair.getSourceGroup();
+  const StemGroup& target = pair.getTargetGroup();
+  Matches matches;
+  matches.reserve(source.size());
+  for (size_t i = 0; i < source.size(); ++i) matches.push_back({source[i], target[i]});
+  std::sort(matches.begin(), matches.end());
+  return matches;
+}
+
+} // namespace tlr
@@ -0,0 +1,69 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef TLR_TOPPAIRS_H_
+#define TLR_TOPPAIRS_H_
+
+#include "PairOfStemGroups.h"
+
+namespace tlr
+{
+
+/**
+ * \brief The k best evaluated pairs, best first
+ *
+ * Each thread keeps its own TopPairs while evaluating pairs and they are
+ * merged at the end, instead of sorting every evaluated pair. Pairs that
+ * are equally good are ranked by their order among the candidates, so the
+ * selection doesn't depend on which thread evaluated them. Many pairs
+ * converge to the same matching stems, only the best of them is kept so
+ * the k pairs are k different transforms.
+ */
+class TopPairs
+{
+ public:
+  explicit TopPairs(size_t k = 1);
+  void add(const PairOfStemGroups& pair, size_t order);
+  void merge(const TopPairs& other);
+  std::vector<PairOfStemGroups> getPairs() const;
+  std::vector<size_t> getOrders() const;
+
+ private:
+  // The corresponding source and target stems, sorted
+  typedef std::vector<std::pair<const Stem*, const Stem*>> Matches;
+  struct RankedPair
+  {
+    PairOfStemGroups pair;
+    size_t order;
+    Matches matches;
+  };
+  static bool better(const PairOfStemGroups& left, size_t leftOrder,
+                     const PairOfStemGroups& right, size_t rightOrder);
+  static Matches getMatches(const PairOfStemGroups& pair);
+  void insert(const PairOfStemGroups& pair, size_t order,
+              const Matches* knownMatches = nullptr);
+
+  std::vector<RankedPair> ranked;
+  size_t k;
+};
+
+} // namespace tlr
+#endif
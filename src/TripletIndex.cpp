@@ -0,0 +1,253 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include "TripletIndex.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <math.h>
+
+namespace tlr
+{
+
+TripletDescriptor
+DescribeTriplet(const Stem* stems, const TripletStems& triplet)
+{
+  TripletDescriptor descriptor;
+  for (size_t i = 0; i < 3; ++i)
+  {
+    size_t next = i == 2 ? 0 : i + 1;
+    descriptor.sides[i] = (stems[triplet[i]].getCoords() - stems[triplet[next]].getCoords()).norm();
+    descriptor.radii[i] = stems[triplet[i]].getRadius();
+  }
+  std::sort(descriptor.sides, descriptor.sides + 3);
+  std::sort(descriptor.radii, descriptor.radii + 3);
+  return descriptor;
+}
+
+// Same test as Registration::relDiamErrorGreaterThanTol, on the sorted radii.
+static bool
+RadiiCorresponding(const TripletDescriptor& d1, const TripletDescriptor& d2,
+                   double diamErrorTol)
+{
+  for (size_t i = 0; i < 3; ++i)
+  {
+    if (fabs(d1.radii[i] - d2.radii[i]) /
+        ((d1.radii[i] + d2.radii[i])/2) > diamErrorTol)
+      return false;
+  }
+  return true;
+}
+
+TripletIndex::TripletIndex() :
+  descriptors(nullptr),
+  nDescriptors(0),
+  slots(nullptr),
+  nSlots(0),
+  members(nullptr),
+  sideTol(0),
+  cellSize(1)
+{
+}
+
+// From descriptors computed beforehand, in the order of the triplets.
+TripletIndex::TripletIndex(std::vector<TripletDescriptor> descriptors, double sideTol) :
+  ownDescriptors(std::move(descriptors)),
+  descriptors(this->ownDescriptors.data()),
+  nDescriptors(this->ownDescriptors.size()),
+  sideTol(sideTol),
+  cellSize(sideTol > 0 ? sideTol : 1)
+{
+  this->build();
+}
+
+// Views the descriptors, only the grid is built
+TripletIndex::TripletIndex(const TripletDescriptor* descriptors, size_t nDescriptors,
+                           double sideTol) :
+  descriptors(descriptors),
+  nDescriptors(nDescriptors),
+  sideTol(sideTol),
+  cellSize(sideTol > 0 ? sideTol : 1)
+{
+  this->build();
+}
+
+// Views an index built with the same sideTol, see getSlots and getMembers
+TripletIndex::TripletIndex(const TripletDescriptor* descriptors, size_t nDescriptors,
+                           double sideTol, const Slot* slots, size_t nSlots,
+                           const uint32_t* members) :
+  descriptors(descriptors),
+  nDescriptors(nDescriptors),
+  slots(slots),
+  nSlots(nSlots),
+  members(members),
+  sideTol(sideTol),
+  cellSize(sideTol > 0 ? sideTol : 1)
+{
+}
+
+/* Sorts the triplets by cell, so the members of a cell are contiguous and in
+   increasing order, then puts each cell in a table at most half full. */
+void
+TripletIndex::build()
+{
+  if (this->nDescriptors > std::numeric_limits<uint32_t>::max())
+    throw std::length_error("Too many triplets to index them");
+  std::vector<GridCell> cells(this->nDescriptors);
+  for (size_t i = 0; i < this->nDescriptors; ++i)
+    cells[i] = this->cellOf(this->descriptors[i]);
+  this->ownMembers.resize(this->nDescriptors);
+  std::iota(this->ownMembers.begin(), this->ownMembers.end(), 0);
+  std::sort(this->ownMembers.begin(), this->ownMembers.end(),
+            [&cells](uint32_t left, uint32_t right) -> bool
+            {
+              const GridCell& l = cells[left];
+              const GridCell& r = cells[right];
+              if (l.x != r.x) return l.x < r.x;
+              if (l.y != r.y) return l.y < r.y;
+              if (l.z != r.z) return l.z < r.z;
+              return left < right;
+            });
+
+  size_t nCells = 0;
+  for (size_t i = 0; i < this->nDescriptors; ++i)
+  {
+    if (i == 0 || !(cells[this->ownMembers[i]] == cells[this->ownMembers[i - 1]]))
+      ++nCells;
+  }
+  this->nSlots = 1;
+  while (this->nSlots < 2*nCells) this->nSlots *= 2;
+  this->ownSlots.assign(this->nSlots, Slot{{0, 0, 0}, 0, 0});
+  this->slots = this->ownSlots.data();
+  this->members = this->ownMembers.data();
+
+  for (size_t begin = 0, end; begin < this->nDescriptors; begin = end)
+  {
+    const GridCell& cell = cells[this->ownMembers[begin]];
+    for (end = begin + 1;
+         end < this->nDescriptors && cells[this->ownMembers[end]] == cell; ++end) {}
+    this->ownSlots[this->slotOf(cell)] = Slot{cell, (uint32_t)begin, (uint32_t)(end - begin)};
+  }
+}
+
+// Slot of the cell, or the empty slot where it would be. Linear probing.
+size_t
+TripletIndex::slotOf(const GridCell& cell) const
+{
+  uint64_t hash = (uint64_t)GridCellHash()(cell)*0x9E3779B97F4A7C15ULL;
+  size_t mask = this->nSlots - 1;
+  size_t i = (size_t)(hash ^ (hash >> 32)) & mask;
+  while (this->slots[i].count != 0 && !(this->slots[i].cell == cell)) i = (i + 1) & mask;
+  return i;
+}
+
+/* Appends the indices of the triplets whose sorted sides are all within
+   sideTol of the descriptor's and whose sorted radii are within diamErrorTol.
+   Every pair accepted by Registration::pairPositionsAreCorresponding and
+   Registration::diametersNotCorresponding passes this test, because sorting
+   the sides never increases the largest difference between them. The
+   candidates are returned in increasing order. */
+void
+TripletIndex::findCandidates(const TripletDescriptor& descriptor,
+                             double diamErrorTol,
+                             std::vector<size_t>& candidates) const
+{
+  if (this->nSlots == 0) return;
+  size_t nBefore = candidates.size();
+  GridCell center = this->cellOf(descriptor);
+  GridCell key;
+
+  for (long long dx = -1; dx <= 1; ++dx)
+  {
+    for (long long dy = -1; dy <= 1; ++dy)
+    {
+      for (long long dz = -1; dz <= 1; ++dz)
+      {
+        key = {center.x + dx, center.y + dy, center.z + dz};
+        const Slot& slot = this->slots[this->slotOf(key)];
+        for (uint32_t k = slot.begin; k < slot.begin + slot.count; ++k)
+        {
+          size_t i = this->members[k];
+          const TripletDescriptor& other = this->descriptors[i];
+          if (fabs(other.sides[0] - descriptor.sides[0]) <= this->sideTol
+              && fabs(other.sides[1] - descriptor.sides[1]) <= this->sideTol
+              && fabs(other.sides[2] - descriptor.sides[2]) <= this->sideTol
+              && RadiiCorresponding(descriptor, other, diamErrorTol))
+            candidates.push_back(i);
+        }
+      }
+    }
+  }
+  std::sort(candidates.begin() + nBefore, candidates.end());
+}
+
+GridCell
+TripletIndex::cellOf(const TripletDescriptor& descriptor) const
+{
+  return {(long long)floor(descriptor.sides[0] / this->cellSize),
+          (long long)floor(descriptor.sides[1] / this->cellSize),
+          (long long)floor(descriptor.sides[2] / this->cellSize)};
+}
+
+const TripletDescriptor&
+TripletIndex::getDescriptor(size_t indice) const
+{
+  return this->descriptors[indice];
+}
+
+size_t
+TripletIndex::size() const
+{
+  return this->nDescriptors;
+}
+
+double
+TripletIndex::getSideTol() const
+{
+  return this->sideTol;
+}
+
+const TripletDescriptor*
+TripletIndex::getDescriptors() const
+{
+  return this->descriptors;
+}
+
+const TripletIndex::Slot*
+TripletIndex::getSlots() const
+{
+  return this->slots;
+}
+
+size_t
+TripletIndex::getNumberOfSlots() const
+{
+  return this->nSlots;
+}
+
+const uint32_t*
+TripletIndex::getMembers() const
+{
+  return this->members;
+}
+
+} // namespace tlr
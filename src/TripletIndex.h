@@ -0,0 +1,109 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef TLR_TRIPLETINDEX_H_
+#define TLR_TRIPLETINDEX_H_
+
+#include "PairOfStemGroups.h"
+#include "HashGrid.h"
+#include <array>
+#include <cstdint>
+
+namespace tlr
+{
+
+// The three stems of a triplet, as indices in their map, sorted by radius
+typedef std::array<uint32_t, 3> TripletStems;
+
+/* Rotation invariant description of a triplet : the length of its three
+   sides and the radius of its three stems, both sorted in increasing order. */
+struct TripletDescriptor
+{
+  double sides[3];
+  double radii[3];
+};
+TripletDescriptor DescribeTriplet(const Stem* stems, const TripletStems& triplet);
+
+/**
+ * \brief Lookup of triplets by their TripletDescriptor
+ *
+ * The triplets are put in a hash grid over their sorted side lengths, with
+ * cells as wide as the side tolerance. A query only visits the 27 cells
+ * around the descriptor instead of every triplet of the map. The radius
+ * tolerance is given with each query.
+ *
+ * The grid is a flat open addressing table whose slots point to runs of an
+ * array of triplet indices, so it can be written to a file and used in
+ * place once mapped, see LoadPreparedStemMap. An index built from arrays it
+ * doesn't own only views them, they must outlive it.
+ */
+class TripletIndex
+{
+ public:
+  // Cell of the grid and its run of triplets, empty if count is 0
+  struct Slot
+  {
+    GridCell cell;
+    uint32_t begin;
+    uint32_t count;
+  };
+
+  TripletIndex();
+  TripletIndex(std::vector<TripletDescriptor> descriptors, double sideTol);
+  TripletIndex(const TripletDescriptor* descriptors, size_t nDescriptors, double sideTol);
+  TripletIndex(const TripletDescriptor* descriptors, size_t nDescriptors, double sideTol,
+               const Slot* slots, size_t nSlots, const uint32_t* members);
+  TripletIndex(TripletIndex&&) = default;
+  TripletIndex& operator=(TripletIndex&&) = default;
+  TripletIndex(const TripletIndex&) = delete;
+  TripletIndex& operator=(const TripletIndex&) = delete;
+
+  void findCandidates(const TripletDescriptor& descriptor, double diamErrorTol,
+                      std::vector<size_t>& candidates) const;
+  size_t size() const;
+  double getSideTol() const;
+  const TripletDescriptor& getDescriptor(size_t indice) const;
+  // The arrays of the index, to write it to a file
+  const TripletDescriptor* getDescriptors() const;
+  const Slot* getSlots() const;
+  size_t getNumberOfSlots() const;
+  const uint32_t* getMembers() const;
+
+ private:
+  GridCell cellOf(const TripletDescriptor& descriptor) const;
+  size_t slotOf(const GridCell& cell) const;
+  void build();
+
+  // Owned, unless the index views arrays built beforehand
+  std::vector<TripletDescriptor> ownDescriptors;
+  std::vector<Slot> ownSlots;
+  std::vector<uint32_t> ownMembers;
+  const TripletDescriptor* descriptors;
+  size_t nDescriptors;
+  const Slot* slots;
+  size_t nSlots; // A power of 2
+  const uint32_t* members; // Indices of the triplets, cell by cell
+  double sideTol;
+  double cellSize;
+};
+
+} // namespace tlr
+#endif
@@ -20,7 +20,13 @@
 
 #include <stdio.h>
 #include <time.h>
-#include "Registration.h"
+#include <fstream>
+#include "BatchRegistration.h"
+#include "HierarchicalRegistration.h"
+#include "MultiScanRegistration.h"
+#include "RegistrationServer.h"
+#include "StemMapCache.h"
+#include "SyntheticForest.h"
 #include <omp.h>
 
 /*
@@ -29,40 +35,338 @@ main.cpp
 Va etre utilise pour tester les fonctionnalite donc va changer tres souvents
 des tests plus rigoureux, unitaires, vont etre implmente tres bientot.
 */
+
+// Statistics of each step of a registration, as JSON, if a path is given
+template <class RegistrationType>
+static int
+WriteStats(const RegistrationType& reg, const std::string& statsPath)
+{
+  if (statsPath.empty()) return 0;
+  std::ofstream file(statsPath);
+  reg.printStats(file);
+  if (!file)
+  {
+    std::cout << "Error while writing " << statsPath << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
-  if (argc != 6 && argc != 7)
+  // Conversion of a text stem map to the binary format, which loads faster
+  if (argc == 4 && std::string(argv[1]) == "--convert")
+  {
+    try
+    {
+      tlr::StemMap stemMap;
+      stemMap.loadStemMapFile(argv[2], -1); // Keep every stem
+      stemMap.saveBinaryStemMapFile(argv[3]);
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  /* Synthetic pair of scans, in the text format, with the transform which
+     registers the source to the target */
+  if (argc == 6 && std::string(argv[1]) == "--generate")
+  {
+    try
+    {
+      tlr::SyntheticForestOptions forestOptions;
+      forestOptions.nStems = std::stoul(argv[2]);
+      forestOptions.seed = std::stoul(argv[3]);
+      tlr::SyntheticForest forest(forestOptions);
+      const char* paths[2] = {argv[4], argv[5]};
+      const tlr::StemMap* stemMaps[2] = {&forest.getSource(), &forest.getTarget()};
+      for (size_t i = 0; i < 2; ++i)
+      {
+        std::ofstream file(paths[i]);
+        file.precision(17);
+        for (const auto& it : stemMaps[i]->getStems())
+        {
+          file << it.getCoords()(0) << " " << it.getCoords()(1) << " "
+               << it.getCoords()(2) << " " << it.getRadius() << "\n";
+        }
+        if (!file)
+        {
+          std::cout << "Error while writing " << paths[i] << std::endl;
+          return 1;
+        }
+      }
+      std::cout << "True transform :" << std::endl << forest.getTransform() << std::endl;
+      return 0;
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // Many registrations, listed in a manifest, sharing the loaded maps
+  if ((argc == 3 || (argc == 5 && std::string(argv[3]) == "--cache-dir"))
+      && std::string(argv[1]) == "--batch")
+  {
+    try
+    {
+      tlr::BatchRegistration batch(tlr::LoadBatchManifest(argv[2]),
+                                   argc == 5 ? argv[4] : "");
+      batch.run();
+      batch.printReports(std::cout);
+      return batch.getNumberOfFailures() == 0 ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // All the scans of a plot, placed in the frame of the first one
+  if (argc >= 5 && std::string(argv[1]) == "--multi")
+  {
+    std::vector<std::string> args(argv, argv + argc);
+    tlr::RegistrationOptions options;
+    std::vector<std::string> paths;
+    std::string cacheDir;
+    size_t nPairs = 0;
+    try
+    {
+      double minDiam = std::stod(args[2]);
+      options.diamErrorTol = std::stod(args[3]);
+      options.RANSACtol = std::stod(args[4]);
+      for (size_t i = 5; i < args.size(); ++i)
+      {
+        if (args[i] == "--pairs" && i + 1 < args.size())
+          nPairs = std::stoul(args[++i]);
+        else if (args[i] == "--cache-dir" && i + 1 < args.size())
+          cacheDir = args[++i];
+        else if (tlr::ParseOption(args, i, options))
+          continue;
+        else if (args[i].compare(0, 2, "--") == 0)
+          throw std::runtime_error("Unknown argument: " + args[i]);
+        else
+          paths.push_back(args[i]);
+      }
+      if (paths.size() < 2) throw std::runtime_error("At least two scans are needed");
+
+      tlr::MultiScanRegistration reg(paths,
+                                     tlr::LoadPreparedStemMaps(paths, minDiam,
+                                                               options.RANSACtol, cacheDir,
+                                                               tlr::NeedsTriplets(options)),
+                                     options, nPairs);
+      reg.run();
+      reg.printReport(std::cout);
+      return reg.getPoseGraph().isConnected() ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // Registration service keeping the reference maps in memory
+  if (argc >= 7 && std::string(argv[1]) == "--serve")
+  {
+    std::vector<std::string> args(argv, argv + argc);
+    tlr::RegistrationOptions options;
+    tlr::ServerOptions serverOptions;
+    std::vector<std::string> references;
+    try
+    {
+      serverOptions.minDiam = std::stod(args[3]);
+      options.diamErrorTol = std::stod(args[4]);
+      options.RANSACtol = std::stod(args[5]);
+      for (size_t i = 6; i < args.size(); ++i)
+      {
+        if (args[i] == "--workers" && i + 1 < args.size())
+          serverOptions.nWorkers = std::stoul(args[++i]);
+        else if (args[i] == "--queue" && i + 1 < args.size())
+          serverOptions.maxQueued = std::stoul(args[++i]);
+        else if (args[i] == "--deadline" && i + 1 < args.size())
+          serverOptions.deadline = std::stod(args[++i]);
+        else if (args[i] == "--cache-dir" && i + 1 < args.size())
+          serverOptions.cacheDir = args[++i];
+        else if (tlr::ParseOption(args, i, options))
+          continue;
+        else if (args[i].compare(0, 2, "--") == 0)
+          throw std::runtime_error("Unknown argument: " + args[i]);
+        else
+          references.push_back(args[i]);
+      }
+      if (references.empty()) throw std::runtime_error("At least one reference is needed");
+
+      tlr::RegistrationServer server(references, options, serverOptions);
+      server.serve(args[2]);
+      return 0;
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  // Request to a running server, its answer is printed
+  if (argc >= 4 && std::string(argv[1]) == "--client")
+  {
+    std::vector<std::string> words(argv + 3, argv + argc);
+    try
+    {
+      // The server may not run in this directory
+      for (size_t i = 1; words[0] == "register" && i < words.size(); ++i)
+      {
+        if (words[i] == "--deadline")
+          ++i;
+        else if (words[i] == "--reference" && i + 1 < words.size())
+        {
+          ++i;
+          words[i] = tlr::ServerPath(words[i]);
+        }
+        else if (words[i].compare(0, 2, "--") != 0)
+          words[i] = tlr::ServerPath(words[i]);
+      }
+      std::string request = words[0];
+      for (size_t i = 1; i < words.size(); ++i) request += " " + words[i];
+      std::string answer = tlr::SendServerRequest(argv[2], request);
+      std::cout << answer << std::endl;
+      return answer.find("{\"status\": \"ok\"") == 0 ? 0 : 1;
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  if (argc < 6)
   {
     std::cout << "Bad number of arguments" << std::endl
-              << "Usage: ./TLR path_source path_target"
-              << "minimum_radius radius_error_tol RANSAC_error_tol"
+              << "Usage: ./TLR path_source path_target "
+              << "minimum_radius radius_error_tol RANSAC_error_tol "
+              << "[kelbe] [--engine new|kelbe|hough] [--streaming] [--batch-size n] [--confidence p] [--top-k k] [--4dof] "
+              << "[--hierarchical n] [--irls n] [--cluster] [--time-limit s] "
+              << "[--cache-dir path] [--stats path]"
+              << std::endl
+              << "       ./TLR --convert path_text_stem_map path_binary_stem_map"
+              << std::endl
+              << "       ./TLR --generate number_of_stems seed path_source path_target"
+              << std::endl
+              << "       ./TLR --batch path_manifest [--cache-dir path]"
+              << std::endl
+              << "       ./TLR --multi minimum_radius radius_error_tol RANSAC_error_tol "
+              << "[--pairs n] [options] path_scan1 path_scan2 ..."
+              << std::endl
+              << "       ./TLR --serve path_socket minimum_radius radius_error_tol RANSAC_error_tol "
+              << "[--workers n] [--queue n] [--deadline s] [options] path_reference1 ..."
+              << std::endl
+              << "       ./TLR --client path_socket register path_source "
+              << "[--reference path_reference] [--deadline s] | status | shutdown"
               << std::endl;
     return 1;
   }
 
-  double minDiam = std::stod(argv[3]);
-  double diamErrorTol = std::stod(argv[4]);
-  double distTol = std::stod(argv[5]);
+  double minDiam = 0;
+  tlr::RegistrationOptions options;
   std::string pathSource = argv[1];
   std::string pathTarget = argv[2];
 
-  tlr::StemMap mapTarget;
-  mapTarget.loadStemMapFile(pathTarget, minDiam);
-
-  tlr::StemMap mapSource;
-  mapSource.loadStemMapFile(pathSource, minDiam);
+  std::string cacheDir;
+  std::string statsPath;
+  std::vector<std::string> args(argv, argv + argc);
+  try
+  {
+    minDiam = std::stod(argv[3]);
+    options.diamErrorTol = std::stod(argv[4]);
+    options.RANSACtol = std::stod(argv[5]);
+    for (size_t i = 6; i < args.size(); ++i)
+    {
+      if (tlr::ParseOption(args, i, options)) continue;
+      if (args[i] == "--cache-dir" && i + 1 < args.size())
+        cacheDir = args[++i];
+      else if (args[i] == "--stats" && i + 1 < args.size())
+        statsPath = args[++i];
+      else if (i == 6 && args[i].compare(0, 2, "--") != 0)
+        options.kelbeRegistration = true; // Any 6th argument used to mean Kelbe
+      else
+      {
+        std::cout << "Unknown argument: " << args[i] << std::endl;
+        return 1;
+      }
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cout << "Error: " << e.what() << std::endl;
+    return 1;
+  }
 
   std::cout << "Registration of "
             << pathSource << " to " << pathTarget << std::endl;
 
   time_t start = time(NULL);
-  tlr::Registration reg = tlr::Registration(mapTarget, mapSource, diamErrorTol, distTol, argc == 7);
-  reg.computeBestTransform();
-  reg.printFinalReport();
-  time_t end = time(NULL);
-  long time = end - start;
+  // The hierarchical registration prepares its own maps, tier by tier
+  if (options.coarseStems > 0)
+  {
+    std::vector<tlr::StemMap> stemMaps;
+    try
+    {
+      stemMaps = tlr::LoadStemMapFiles({pathTarget, pathSource}, minDiam);
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << "Error while loading the stem maps: " << e.what() << std::endl;
+      return 1;
+    }
+    try
+    {
+      tlr::HierarchicalRegistration reg(stemMaps[0], stemMaps[1], options);
+      reg.computeBestTransform();
+      reg.printFinalReport();
+      std::cout << "End of registration. Total time (s) : " << time(NULL) - start << std::endl;
+      return WriteStats(reg, statsPath);
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
 
-  std::cout << "End of registration. Total time (s) : " << time << std::endl;
+  // The maps are prepared, or restored from the cache, while loading them
+  std::vector<std::shared_ptr<const tlr::PreparedStemMap>> stemMaps;
+  try
+  {
+    stemMaps = tlr::LoadPreparedStemMaps({pathTarget, pathSource}, minDiam,
+                                         options.RANSACtol, cacheDir,
+                                         tlr::NeedsTriplets(options));
+  }
+  catch (const std::exception& e)
+  {
+    std::cout << "Error while loading the stem maps: " << e.what() << std::endl;
+    return 1;
+  }
 
-  return 0;
+  try
+  {
+    tlr::Registration reg(stemMaps[0], stemMaps[1], options);
+    reg.computeBestTransform();
+    reg.printFinalReport();
+    time_t end = time(NULL);
+    long time = end - start;
+
+    std::cout << "End of registration. Total time (s) : " << time << std::endl;
+    return WriteStats(reg, statsPath);
+  }
+  catch (const std::exception& e)
+  {
+    std::cout << "Error: " << e.what() << std::endl;
+    return 1;
+  }
 }
@@ -0,0 +1,472 @@
+/***************************************************************************
+ *   Copyright (C) 2017 by Jean-François Tremblay                          *
+ *   jftremblay255@gmail.com                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include "BatchRegistration.h"
+#include "HierarchicalRegistration.h"
+#include "SyntheticForest.h"
+#include <omp.h>
+
+/*
+main_benchmark.cpp
+
+Microbenchmarks of the steps of the registration, on synthetic stem maps,
+for several numbers of stems and threads. Each benchmark is run once to
+warm up then timed over several repetitions with a monotonic clock. The
+results are written as JSON with --json, so two commits can be compared
+with python_utils/benchmark_compare.py.
+
+With --scaling, whole registrations of synthetic plots of increasing size
+instead, checked against their known transform.
+*/
+
+struct BenchmarkResult
+{
+  std::string name;
+  size_t nStems;    // Asked for, the key of the result in the sweep
+  size_t nMapStems; // In the generated map, without the missed stems
+  int nThreads;
+  size_t nItems; // What the benchmark processes : stems, triplets, pairs...
+  std::vector<double> times; // Seconds, one per repetition
+};
+
+/* Runs the benchmarks whose name contains filter and keeps their results,
+   with the stem counts of the current step of the sweep. Each one is run
+   once to warm up, then timed nRepetitions times. */
+struct Benchmarker
+{
+  size_t nRepetitions;
+  std::string filter;
+  std::vector<BenchmarkResult> results;
+  size_t nStems = 0;
+  size_t nMapStems = 0;
+
+  void run(const std::string& name, size_t nItems, const std::function<void()>& function)
+  {
+    if (name.find(this->filter) == std::string::npos) return;
+    BenchmarkResult result = {name, this->nStems, this->nMapStems,
+                              omp_get_max_threads(), nItems, {}};
+    function();
+    for (size_t i = 0; i < this->nRepetitions; ++i)
+    {
+      auto start = std::chrono::steady_clock::now();
+      function();
+      auto end = std::chrono::steady_clock::now();
+      result.times.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    this->results.push_back(result);
+  }
+};
+
+static double
+Median(std::vector<double> values)
+{
+  std::sort(values.begin(), values.end());
+  size_t middle = values.size()/2;
+  return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle])/2;
+}
+
+static double
+Mean(const std::vector<double>& values)
+{
+  double sum = 0;
+  for (double it : values) sum += it;
+  return sum / values.size();
+}
+
+static double
+StandardDeviation(const std::vector<double>& values)
+{
+  if (values.size() < 2) return 0;
+  double mean = Mean(values);
+  double sum = 0;
+  for (double it : values) sum += (it - mean)*(it - mean);
+  return sqrt(sum / (values.size() - 1));
+}
+
+static std::vector<size_t>
+ParseList(const std::string& list)
+{
+  std::vector<size_t> values;
+  std::istringstream stream(list);
+  std::string value;
+  while (std::getline(stream, value, ',')) values.push_back(std::stoul(value));
+  return values;
+}
+
+// Benchmarks of the steps which don't depend on the number of threads
+static void
+RunSerialBenchmarks(const tlr::SyntheticForest& maps, Benchmarker& benchmarker)
+{
+  size_t nStems = maps.getTarget().getStems().size();
+  std::string prefix = (std::filesystem::temp_directory_path()
+                        / ("tlr_benchmark_" + std::to_string(benchmarker.nStems))).string();
+  std::string textPath = prefix + ".txt";
+  std::string binaryPath = prefix + ".bin";
+  {
+    std::ofstream file(textPath);
+    file.precision(17);
+    for (const auto& it : maps.getTarget().getStems())
+    {
+      file << it.getCoords()(0) << " " << it.getCoords()(1) << " "
+           << it.getCoords()(2) << " " << it.getRadius() << "\n";
+    }
+  }
+  maps.getTarget().saveBinaryStemMapFile(binaryPath);
+
+  benchmarker.run("load_text", nStems, [&]()
+  {
+    tlr::StemMap stemMap;
+    stemMap.loadStemMapFile(textPath, 0);
+  });
+  benchmarker.run("load_binary", nStems, [&]()
+  {
+    tlr::StemMap stemMap;
+    stemMap.loadStemMapFile(binaryPath, 0);
+  });
+  std::remove(textPath.c_str());
+  std::remove(binaryPath.c_str());
+
+  std::vector<tlr::TripletStems> triplets;
+  tlr::GenerateTriplets(maps.getTarget(), triplets);
+  benchmarker.run("generate_triplets", triplets.size(), [&]()
+  {
+    std::vector<tlr::TripletStems> generated;
+    tlr::GenerateTriplets(maps.getTarget(), generated);
+  });
+
+  benchmarker.run("prepare_map", nStems, [&]()
+  {
+    tlr::PreparedStemMap prepared(maps.getTarget(), 0.10);
+  });
+
+  // The transform of triplets to themselves, which is how RANSAC starts
+  size_t nTransforms = std::min(triplets.size(), (size_t)100000);
+  const auto& stems = maps.getTarget().getStems();
+  std::vector<tlr::StemGroup> groups;
+  for (size_t i = 0; i < nTransforms; ++i)
+  {
+    const tlr::TripletStems& it = triplets[i];
+    groups.push_back({&stems[it[0]], &stems[it[1]], &stems[it[2]]});
+  }
+  benchmarker.run("best_transform", nTransforms, [&]()
+  {
+    for (size_t i = 0; i < nTransforms; ++i)
+    {
+      tlr::PairOfStemGroups pair(groups[i], groups[i]);
+      pair.computeBestTransform();
+    }
+  });
+}
+
+/* Benchmarks of the parallel steps of a registration with the current
+   number of threads. Their items are the source triplets. */
+static void
+RunParallelBenchmarks(const tlr::SyntheticForest& maps, Benchmarker& benchmarker)
+{
+  std::ostringstream log; // Registration messages aren't shown
+  tlr::RegistrationOptions options;
+  options.log = &log;
+  auto target = std::make_shared<const tlr::PreparedStemMap>(maps.getTarget(), options.RANSACtol);
+  auto source = std::make_shared<const tlr::PreparedStemMap>(maps.getSource(), options.RANSACtol);
+  size_t nSourceTriplets = source->getNumberOfTriplets();
+
+  // The constructor matches the radii and generates the pairs
+  benchmarker.run("generate_pairs", nSourceTriplets, [&]()
+  {
+    tlr::Registration reg(target, source, options);
+    log.str("");
+  });
+
+  // Each pair : first transform, search of the other stems and refinement
+  tlr::Registration reg(target, source, options);
+  benchmarker.run("ransac", nSourceTriplets, [&]()
+  {
+    reg.computeBestTransform();
+  });
+
+  // Selection of the best pairs among evaluated ones, as computeBestTransform does
+  std::vector<tlr::PairOfStemGroups> pairs;
+  for (size_t i = 0; i < std::min(target->getNumberOfTriplets(), (size_t)100000); ++i)
+  {
+    tlr::StemGroup triplet = target->getTriplet(i);
+    pairs.push_back(tlr::PairOfStemGroups(triplet, triplet));
+    pairs.back().computeBestTransform();
+  }
+  benchmarker.run("select_top_k", pairs.size(), [&]()
+  {
+    std::vector<tlr::TopPairs> threadBest(omp_get_max_threads(), tlr::TopPairs(10));
+    #pragma omp parallel for
+    for (size_t i = 0; i < pairs.size(); ++i)
+      threadBest[omp_get_thread_num()].add(pairs[i], i);
+    tlr::TopPairs best(10);
+    for (const auto& it : threadBest) best.merge(it);
+  });
+}
+
+static void
+WriteJson(std::ostream& out, const std::vector<BenchmarkResult>& results)
+{
+  out << "{\n  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const BenchmarkResult& it = results[i];
+    out << "    {\"name\": \"" << it.name << "\", \"stems\": " << it.nStems
+        << ", \"map_stems\": " << it.nMapStems
+        << ", \"threads\": " << it.nThreads << ", \"items\": " << it.nItems
+        << ", \"repetitions\": " << it.times.size()
+        << ", \"min_s\": " << *std::min_element(it.times.begin(), it.times.end())
+        << ", \"median_s\": " << Median(it.times)
+        << ", \"mean_s\": " << Mean(it.times)
+        << ", \"stddev_s\": " << StandardDeviation(it.times) << "}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+// One size of the scaling benchmark
+struct ScalingResult
+{
+  size_t nStems;
+  double time;          // Seconds, preparation of the maps and registration
+  size_t peakMemory;    // Bytes of resident memory, 0 if unknown
+  double angleError;    // Degrees
+  double distanceError; // Meters
+  double stemError;     // RMS distance between the registered and true stems
+  size_t nStemsUsed;    // Inliers of the best transform
+  bool success;         // Transform found and close to the truth
+};
+
+/* Peak resident memory of the process since the last ResetPeakMemory, read
+   from /proc on Linux. */
+static void
+ResetPeakMemory()
+{
+#ifdef __linux__
+  std::ofstream file("/proc/self/clear_refs");
+  file << "5";
+#endif
+}
+
+static size_t
+PeakMemory()
+{
+#ifdef __linux__
+  std::ifstream file("/proc/self/status");
+  std::string line;
+  while (std::getline(file, line))
+  {
+    if (line.compare(0, 7, "VmHWM:\t") == 0)
+      return std::stoull(line.substr(7)) * 1024;
+  }
+#endif
+  return 0;
+}
+
+/* Whole registrations of synthetic plots of nStems stems, from the
+   preparation of the maps to the best transform, compared to the transform
+   used to generate them. */
+static std::vector<ScalingResult>
+RunScaling(const std::vector<size_t>& stemCounts,
+           const tlr::RegistrationOptions& registrationOptions, unsigned int seed)
+{
+  std::vector<ScalingResult> results;
+  for (size_t nStems : stemCounts)
+  {
+    tlr::SyntheticForestOptions forestOptions;
+    forestOptions.nStems = nStems;
+    forestOptions.seed = seed;
+    // The 4-DOF registration assumes levelled scans
+    if (!tlr::NeedsTriplets(registrationOptions)) forestOptions.maxTilt = 0;
+    tlr::SyntheticForest forest(forestOptions);
+
+    std::ostringstream log;
+    tlr::RegistrationOptions options = registrationOptions;
+    options.log = &log;
+    ScalingResult result = {nStems, 0, 0, 180, INFINITY, INFINITY, 0, false};
+    ResetPeakMemory();
+    auto start = std::chrono::steady_clock::now();
+    Eigen::Matrix4d transform;
+    std::vector<tlr::PairOfStemGroups> bestPairs;
+    if (options.coarseStems > 0)
+    {
+      tlr::HierarchicalRegistration reg(forest.getTarget(), forest.getSource(), options);
+      reg.computeBestTransform();
+      bestPairs = reg.getBestPairs();
+    }
+    else
+    {
+      auto target = std::make_shared<const tlr::PreparedStemMap>(
+        forest.getTarget(), options.RANSACtol, tlr::NeedsTriplets(options));
+      auto source = std::make_shared<const tlr::PreparedStemMap>(
+        forest.getSource(), options.RANSACtol, tlr::NeedsTriplets(options));
+      tlr::Registration reg(target, source, options);
+      reg.computeBestTransform();
+      bestPairs = reg.getBestPairs();
+    }
+    if (!bestPairs.empty())
+    {
+      transform = bestPairs[0].getBestTransform();
+      result.nStemsUsed = bestPairs[0].getSourceGroup().size();
+    }
+    result.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.peakMemory = PeakMemory();
+
+    if (result.nStemsUsed > 0)
+    {
+      tlr::TransformError(transform, forest.getTransform(), forest.getSource(),
+                          result.angleError, result.distanceError, result.stemError);
+      result.success = result.stemError < options.RANSACtol;
+    }
+    results.push_back(result);
+  }
+  return results;
+}
+
+static void
+WriteScalingJson(std::ostream& out, const std::vector<ScalingResult>& results)
+{
+  out << "{\n  \"scaling\": [\n";
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const ScalingResult& it = results[i];
+    out << "    {\"stems\": " << it.nStems << ", \"time_s\": " << it.time
+        << ", \"peak_rss_bytes\": " << it.peakMemory
+        << ", \"rotation_error_deg\": " << it.angleError
+        << ", \"translation_error_m\": " << it.distanceError
+        << ", \"stem_rmse_m\": " << it.stemError
+        << ", \"stems_used\": " << it.nStemsUsed
+        << ", \"success\": " << (it.success ? "true" : "false") << "}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<size_t> stemCounts = {20, 40, 80};
+  std::vector<size_t> threadCounts = {1, (size_t)omp_get_max_threads()};
+  Benchmarker benchmarker = {5, "", {}};
+  std::string jsonPath;
+  std::vector<size_t> scalingCounts;
+  tlr::RegistrationOptions scalingOptions;
+  unsigned int seed = 1;
+
+  std::vector<std::string> args(argv, argv + argc);
+  for (size_t i = 1; i < args.size(); ++i)
+  {
+    bool hasValue = i + 1 < args.size();
+    if (args[i] == "--stems" && hasValue)
+      stemCounts = ParseList(args[++i]);
+    else if (args[i] == "--threads" && hasValue)
+      threadCounts = ParseList(args[++i]);
+    else if (args[i] == "--repetitions" && hasValue)
+      benchmarker.nRepetitions = std::max((size_t)1, (size_t)std::stoul(args[++i]));
+    else if (args[i] == "--json" && hasValue)
+      jsonPath = args[++i];
+    else if (args[i] == "--filter" && hasValue)
+      benchmarker.filter = args[++i];
+    else if (args[i] == "--scaling" && hasValue)
+      scalingCounts = ParseList(args[++i]);
+    else if (args[i] == "--seed" && hasValue)
+      seed = std::stoul(args[++i]);
+    else if (!tlr::ParseOption(args, i, scalingOptions))
+    {
+      std::cout << "Usage: ./TLR_BENCH [--stems n1,n2,...] [--threads t1,t2,...] "
+                << "[--repetitions r] [--json path] [--filter name]" << std::endl;
+      std::cout << "       ./TLR_BENCH --scaling n1,n2,... [--seed s] [--json path] "
+                << "[registration options]" << std::endl;
+      return 1;
+    }
+  }
+
+  if (!scalingCounts.empty())
+  {
+    std::vector<ScalingResult> results = RunScaling(scalingCounts, scalingOptions, seed);
+    printf("%7s %10s %12s %12s %12s %12s %7s %8s\n", "stems", "time (s)", "peak (MiB)",
+           "angle (deg)", "dist (m)", "stems (m)", "used", "success");
+    for (const auto& it : results)
+    {
+      printf("%7zu %10.3f %12.1f %12.4f %12.4f %12.4f %7zu %8s\n",
+             it.nStems, it.time, it.peakMemory/1048576.0, it.angleError,
+             it.distanceError, it.stemError, it.nStemsUsed, it.success ? "yes" : "no");
+    }
+    if (!jsonPath.empty())
+    {
+      std::ofstream file(jsonPath);
+      WriteScalingJson(file, results);
+      if (!file)
+      {
+        std::cout << "Error while writing " << jsonPath << std::endl;
+        return 1;
+      }
+    }
+    return 0;
+  }
+  threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()),
+                     threadCounts.end());
+
+  for (size_t nStems : stemCounts)
+  {
+    tlr::SyntheticForestOptions forestOptions;
+    forestOptions.nStems = nStems;
+    tlr::SyntheticForest maps(forestOptions);
+    benchmarker.nStems = nStems;
+    benchmarker.nMapStems = maps.getTarget().getStems().size();
+    omp_set_num_threads(1);
+    RunSerialBenchmarks(maps, benchmarker);
+    for (size_t nThreads : threadCounts)
+    {
+      omp_set_num_threads(nThreads);
+      RunParallelBenchmarks(maps, benchmarker);
+    }
+  }
+  const std::vector<BenchmarkResult>& results = benchmarker.results;
+
+  printf("%-18s %7s %7s %7s %10s %12s %12s %10s\n", "benchmark", "stems",
+         "in map", "threads", "items", "median (ms)", "min (ms)", "stddev");
+  for (const auto& it : results)
+  {
+    printf("%-18s %7zu %7zu %7d %10zu %12.3f %12.3f %9.1f%%\n",
+           it.name.c_str(), it.nStems, it.nMapStems, it.nThreads, it.nItems,
+           Median(it.times)*1e3, *std::min_element(it.times.begin(), it.times.end())*1e3,
+           100*StandardDeviation(it.times)/Mean(it.times));
+  }
+
+  if (!jsonPath.empty())
+  {
+    std::ofstream file(jsonPath);
+    WriteJson(file, results);
+    if (!file)
+    {
+      std::cout << "Error while writing " << jsonPath << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}